@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <string.h>
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+/* Looks for key starting from the field after the last match, since
+   documents usually list keys in the same order as the descriptors */
+static const ubjson_field_t *find_field(const ubjson_field_t *fields, size_t nfields,
+                                        size_t *hint, const char *key, size_t keylen)
+{
+    size_t i, n;
+
+    for(n = 0, i = *hint; n < nfields; ++n, i = (i + 1 == nfields) ? 0 : i + 1) {
+        if(!strncmp(fields[i].key, key, keylen) && fields[i].key[keylen] == '\0') {
+            *hint = (i + 1 == nfields) ? 0 : i + 1;
+            return &fields[i];
+        }
+    }
+    return NULL;
+}
+
+static int load_array(ubjsonp_scan_t *s, const ubjson_field_t *field, char *base, int type)
+{
+    int esize = ubjsonp_type_size(field->elem_type);
+    size_t n;
+
+    if(type != '[')
+        return ubjsonp_scan_error(s, "array expected");
+    if(esize <= 0)
+        return ubjsonp_scan_error(s, "unsupported element type");
+    if(ubjsonp_scan_typed_array(s, field->elem_type, base + field->offset, field->size / esize, &n))
+        return -1;
+    memcpy(base + field->count_offset, &n, sizeof(n));
+    return 0;
+}
+
+static int load_field(ubjsonp_scan_t *s, const ubjson_field_t *field, char *base, int type)
+{
+    char *dst = base + field->offset;
+
+    if(type == 'Z')
+        return 0;
+
+    switch(field->type) {
+        case 'i': case 'U': case 'I': case 'l': case 'L': case 'd': case 'D':
+            return ubjsonp_scan_number(s, field->type, type, dst);
+        case 'T':
+            if(type != 'T' && type != 'F')
+                return ubjsonp_scan_error(s, "boolean expected");
+            if(field->size == sizeof(int)) {
+                int x = (type == 'T');
+                memcpy(dst, &x, sizeof(x));
+            }
+            else
+                *(unsigned char *)dst = (type == 'T');
+            return 0;
+        case 'S': {
+            const char *str;
+            size_t len;
+
+            if(type == 'C') {
+                str = (const char *)s->data + s->pos;
+                len = 1;
+                if(ubjsonp_scan_byte(s) == EOF)
+                    return ubjsonp_scan_error(s, "premature end of input");
+            }
+            else if(type != 'S')
+                return ubjsonp_scan_error(s, "string expected");
+            else if(ubjsonp_scan_string(s, &str, &len))
+                return -1;
+            if(len >= field->size)
+                return ubjsonp_scan_error(s, "string too long");
+            memcpy(dst, str, len);
+            dst[len] = '\0';
+            return 0;
+        }
+        case 'r': {
+            ubjson_string_ref_t ref;
+
+            if(type == 'C') {
+                ref.str = (const char *)s->data + s->pos;
+                ref.len = 1;
+                if(ubjsonp_scan_byte(s) == EOF)
+                    return ubjsonp_scan_error(s, "premature end of input");
+            }
+            else if(type != 'S')
+                return ubjsonp_scan_error(s, "string expected");
+            else if(ubjsonp_scan_string(s, &ref.str, &ref.len))
+                return -1;
+            memcpy(dst, &ref, sizeof(ref));
+            return 0;
+        }
+        case '[':
+            return load_array(s, field, base, type);
+        default:
+            return ubjsonp_scan_error(s, "unsupported field type");
+    }
+}
+
+int ubjson_loadb_struct(const void *buffer, size_t buflen, const ubjson_field_t *fields, size_t nfields,
+                        void *out, size_t flags, json_error_t *error)
+{
+    ubjsonp_scan_t s;
+    ubjsonp_container_t c;
+    const ubjson_field_t *field;
+    const char *key;
+    size_t keylen, hint = 0;
+    int r, type;
+
+    jsonp_error_init(error, "<buffer>");
+
+    if(!buffer || !out || (nfields && !fields)) {
+        jsonp_error_set(error, -1, -1, 0, "wrong arguments");
+        return -1;
+    }
+
+    ubjsonp_scan_init(&s, buffer, buflen, error);
+    if(ubjsonp_scan_marker(&s) != '{')
+        return ubjsonp_scan_error(&s, "'{' expected");
+    if(ubjsonp_scan_open(&s, '{', &c, NULL, 0))
+        return -1;
+
+    while((r = ubjsonp_scan_next(&s, &c, &key, &keylen, &type)) == 1) {
+        field = find_field(fields, nfields, &hint, key, keylen);
+        if(field) {
+            s.context = field->key;
+            r = load_field(&s, field, out, type);
+            s.context = NULL;
+        }
+        else
+            r = ubjsonp_scan_skip(&s, type);
+        if(r)
+            return -1;
+    }
+    if(r < 0)
+        return -1;
+
+    if(!(flags & JSON_DISABLE_EOF_CHECK) && s.pos != s.len)
+        return ubjsonp_scan_error(&s, "end of file expected");
+    return 0;
+}
+
+static int dump_field(const ubjson_field_t *field, const char *base,
+                      json_dump_callback_t dump, void *data)
+{
+    const char *src = base + field->offset;
+    unsigned char buf[9];
+
+    if(ubjsonp_dump_buf(field->key, strlen(field->key), dump, data))
+        return -1;
+
+    switch(field->type) {
+        case 'i': case 'U': case 'I': case 'l': case 'L':
+            return ubjsonp_dump_int(ubjsonp_get_native_int(src, field->type), dump, data);
+        case 'd': case 'D': {
+            int sz = ubjsonp_type_size(field->type);
+
+            buf[0] = field->type;
+            ubjsonp_copy_be(buf + 1, src, sz, 1);
+            return dump((char *)buf, sz + 1, data);
+        }
+        case 'T': {
+            int x;
+
+            if(field->size == sizeof(int))
+                memcpy(&x, src, sizeof(x));
+            else
+                x = *(const unsigned char *)src;
+            return dump(x ? "T" : "F", 1, data);
+        }
+        case 'S':
+            if(dump("S", 1, data))
+                return -1;
+            return ubjsonp_dump_buf(src, strnlen(src, field->size), dump, data);
+        case 'r': {
+            ubjson_string_ref_t ref;
+
+            memcpy(&ref, src, sizeof(ref));
+            if(dump("S", 1, data))
+                return -1;
+            return ubjsonp_dump_buf(ref.str, ref.len, dump, data);
+        }
+        case '[': {
+            size_t count;
+            int esize = ubjsonp_type_size(field->elem_type);
+
+            if(esize <= 0)
+                return -1;
+            memcpy(&count, base + field->count_offset, sizeof(count));
+            if(count > field->size / esize)
+                return -1;
+            return ubjson_dump_typed_array(field->elem_type, src, count, dump, data);
+        }
+        default:
+            return -1;
+    }
+}
+
+int ubjson_dump_struct_callback(const void *in, const ubjson_field_t *fields, size_t nfields,
+                                json_dump_callback_t callback, void *data)
+{
+    size_t i;
+
+    if(!in || (nfields && !fields))
+        return -1;
+
+    if(callback("{#", 2, data) || ubjsonp_dump_int(nfields, callback, data))
+        return -1;
+    for(i = 0; i < nfields; ++i)
+        if(dump_field(&fields[i], in, callback, data))
+            return -1;
+    return 0;
+}
+
+ssize_t ubjson_dumpb_struct(const void *in, const ubjson_field_t *fields, size_t nfields,
+                            void *buffer, size_t buflen)
+{
+    struct ubjsonp_dumpb_data data;
+
+    data.p = buffer;
+    data.rem = buflen;
+    data.sz = 0;
+
+    if(ubjson_dump_struct_callback(in, fields, nfields, ubjsonp_dumpb_callback, &data))
+        return -1;
+
+    return data.sz;
+}
@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/*
+ * Remembers the encoding of every array and object written through it,
+ * keyed on the json_t pointer.  Each entry holds a reference to its
+ * value, so a pointer cannot be reused by another value while cached,
+ * and lists the containers it was written from and the containers
+ * written inside it.  Invalidating a value forgets its encoding and
+ * that of every container including it, but keeps their entries; when
+ * one is written again, the children it no longer includes lose it as
+ * a parent, and entries left without parents are released, so children
+ * replaced since the last dump are not kept alive.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+#define INITIAL_BUCKETS  64
+
+typedef struct entry {
+    struct entry *next;
+    json_t *json;
+    size_t flags;
+    unsigned char *bytes;  /* NULL once invalidated */
+    size_t len;
+    json_t **parents;
+    size_t nparents;
+    size_t parents_size;
+    json_t **children;  /* sorted by address */
+    size_t nchildren;
+} entry_t;
+
+struct ubjson_cache {
+    entry_t **buckets;
+    size_t nbuckets;
+    size_t entries;
+    size_t invalid;  /* entries without an encoding */
+
+    /* while dumping: the real output, and every byte written since the
+       outermost uncached container began */
+    json_dump_callback_t dump;
+    void *data;
+    unsigned char *record;
+    size_t record_len;
+    size_t record_size;
+    int recording;
+
+    /* containers finished inside the ones being recorded, each level
+       started by a NULL */
+    json_t **pending;
+    size_t pending_len;
+    size_t pending_size;
+};
+
+static size_t hash_ptr(const json_t *json, size_t nbuckets)
+{
+    uintptr_t h = (uintptr_t)json;
+
+    h ^= h >> 17;
+    h *= 0x9E3779B1U;
+    h ^= h >> 15;
+    return h & (nbuckets - 1);
+}
+
+static entry_t **find(ubjson_cache_t *cache, const json_t *json)
+{
+    entry_t **e = &cache->buckets[hash_ptr(json, cache->nbuckets)];
+
+    while(*e && (*e)->json != json)
+        e = &(*e)->next;
+    return e;
+}
+
+static void free_entry(entry_t *e)
+{
+    json_decref(e->json);
+    free(e->bytes);
+    free(e->parents);
+    free(e->children);
+    free(e);
+}
+
+static int grow(ubjson_cache_t *cache)
+{
+    size_t nbuckets = cache->nbuckets * 2, i;
+    entry_t **buckets = calloc(nbuckets, sizeof(entry_t *));
+
+    if(!buckets)
+        return -1;
+    for(i = 0; i < cache->nbuckets; ++i) {
+        entry_t *e = cache->buckets[i], *next;
+        for(; e; e = next) {
+            size_t b = hash_ptr(e->json, nbuckets);
+            next = e->next;
+            e->next = buckets[b];
+            buckets[b] = e;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+    return 0;
+}
+
+static int add_parent(entry_t *e, json_t *parent)
+{
+    size_t i;
+
+    if(!parent)
+        return 0;
+    for(i = 0; i < e->nparents; ++i)
+        if(e->parents[i] == parent)
+            return 0;
+    if(e->nparents == e->parents_size) {
+        size_t size = e->parents_size ? e->parents_size * 2 : 1;
+        json_t **parents = realloc(e->parents, size * sizeof(json_t *));
+        if(!parents)
+            return -1;
+        e->parents = parents;
+        e->parents_size = size;
+    }
+    e->parents[e->nparents++] = parent;
+    return 0;
+}
+
+static int push_pending(ubjson_cache_t *cache, json_t *json)
+{
+    if(cache->pending_len == cache->pending_size) {
+        size_t size = cache->pending_size ? cache->pending_size * 2 : 16;
+        json_t **pending = realloc(cache->pending, size * sizeof(json_t *));
+        if(!pending)
+            return -1;
+        cache->pending = pending;
+        cache->pending_size = size;
+    }
+    cache->pending[cache->pending_len++] = json;
+    return 0;
+}
+
+static int compare_ptrs(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(json_t *const *)a, y = (uintptr_t)*(json_t *const *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void release(ubjson_cache_t *cache, json_t *json);
+
+/* Removes parent from the parents of child, releasing child if it was
+   the last one */
+static void unlink_child(ubjson_cache_t *cache, json_t *parent, json_t *child)
+{
+    entry_t *e = *find(cache, child);
+    size_t i;
+
+    if(!e)
+        return;
+    for(i = 0; i < e->nparents; ++i) {
+        if(e->parents[i] == parent) {
+            e->parents[i] = e->parents[--e->nparents];
+            if(!e->nparents)
+                release(cache, child);
+            return;
+        }
+    }
+}
+
+/* Frees the entry of json and unlinks it from the entries of its children */
+static void release(ubjson_cache_t *cache, json_t *json)
+{
+    entry_t **slot = find(cache, json), *e = *slot;
+    size_t i;
+
+    if(!e)
+        return;
+    *slot = e->next;
+    cache->entries--;
+    if(!e->bytes)
+        cache->invalid--;
+    for(i = 0; i < e->nchildren; ++i)
+        unlink_child(cache, json, e->children[i]);
+    free_entry(e);
+}
+
+/* Forgets the encoding of json and of every container that includes it */
+static void invalidate(ubjson_cache_t *cache, json_t *json)
+{
+    entry_t *e = *find(cache, json);
+    size_t i;
+
+    if(!e || !e->bytes)
+        return;
+    free(e->bytes);
+    e->bytes = NULL;
+    e->len = 0;
+    cache->invalid++;
+    for(i = 0; i < e->nparents; ++i)
+        invalidate(cache, e->parents[i]);
+}
+
+ubjson_cache_t *ubjson_cache_new(void)
+{
+    ubjson_cache_t *cache = calloc(1, sizeof(*cache));
+
+    if(!cache)
+        return NULL;
+    cache->nbuckets = INITIAL_BUCKETS;
+    cache->buckets = calloc(cache->nbuckets, sizeof(entry_t *));
+    if(!cache->buckets) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void ubjson_cache_clear(ubjson_cache_t *cache)
+{
+    size_t i;
+
+    for(i = 0; i < cache->nbuckets; ++i) {
+        entry_t *e = cache->buckets[i], *next;
+        for(; e; e = next) {
+            next = e->next;
+            free_entry(e);
+        }
+        cache->buckets[i] = NULL;
+    }
+    cache->entries = 0;
+    cache->invalid = 0;
+}
+
+void ubjson_cache_free(ubjson_cache_t *cache)
+{
+    if(!cache)
+        return;
+    ubjson_cache_clear(cache);
+    free(cache->buckets);
+    free(cache->record);
+    free(cache->pending);
+    free(cache);
+}
+
+void ubjson_cache_invalidate(ubjson_cache_t *cache, json_t *json)
+{
+    invalidate(cache, json);
+}
+
+size_t ubjson_cache_size(const ubjson_cache_t *cache)
+{
+    return cache->entries - cache->invalid;
+}
+
+void ubjsonp_cache_attach(ubjson_cache_t *cache, json_dump_callback_t dump, void *data)
+{
+    cache->dump = dump;
+    cache->data = data;
+    cache->recording = 0;
+    cache->record_len = 0;
+    cache->pending_len = 0;
+}
+
+int ubjsonp_cache_callback(const char *buffer, size_t size, void *data)
+{
+    ubjson_cache_t *cache = data;
+
+    if(cache->recording) {
+        if(size > cache->record_size - cache->record_len) {
+            size_t record_size = cache->record_size ? cache->record_size : 256;
+            unsigned char *record;
+
+            while(size > record_size - cache->record_len)
+                record_size *= 2;
+            record = realloc(cache->record, record_size);
+            if(!record)
+                return -1;
+            cache->record = record;
+            cache->record_size = record_size;
+        }
+        memcpy(cache->record + cache->record_len, buffer, size);
+        cache->record_len += size;
+    }
+    return cache->dump(buffer, size, cache->data);
+}
+
+int ubjsonp_cache_emit(ubjson_cache_t *cache, json_t *json, json_t *parent, size_t flags)
+{
+    entry_t *e = *find(cache, json);
+
+    if(!e || !e->bytes || e->flags != flags)
+        return 0;
+    if(add_parent(e, parent) || (parent && push_pending(cache, json)))
+        return -1;
+    if(ubjsonp_cache_callback((const char *)e->bytes, e->len, cache))
+        return -1;
+    return 1;
+}
+
+int ubjsonp_cache_begin(ubjson_cache_t *cache, size_t *start)
+{
+    if(push_pending(cache, NULL))
+        return -1;
+    cache->recording++;
+    *start = cache->record_len;
+    return 0;
+}
+
+int ubjsonp_cache_end(ubjson_cache_t *cache, json_t *json, json_t *parent, size_t flags, size_t start)
+{
+    entry_t **slot, *e;
+    size_t len = cache->record_len - start, level = cache->pending_len, nchildren, i, j;
+    unsigned char *bytes = malloc(len ? len : 1);
+    json_t **children;
+
+    while(cache->pending[--level])
+        ;
+    nchildren = cache->pending_len - level - 1;
+    children = malloc((nchildren ? nchildren : 1) * sizeof(json_t *));
+    if(!bytes || !children) {
+        free(bytes);
+        free(children);
+        return -1;
+    }
+    memcpy(bytes, cache->record + start, len);
+    memcpy(children, cache->pending + level + 1, nchildren * sizeof(json_t *));
+    qsort(children, nchildren, sizeof(json_t *), compare_ptrs);
+    cache->pending_len = level;
+    if(--cache->recording == 0)
+        cache->record_len = 0;
+
+    e = *find(cache, json);
+    if(e) {
+        /* children written last time but not this time lose json as a parent */
+        for(i = j = 0; i < e->nchildren; ++i) {
+            while(j < nchildren && compare_ptrs(&children[j], &e->children[i]) < 0)
+                ++j;
+            if(j == nchildren || children[j] != e->children[i])
+                unlink_child(cache, json, e->children[i]);
+        }
+    }
+
+    /* releasing children may have moved entries around */
+    slot = find(cache, json);
+    e = *slot;
+    if(!e) {
+        e = calloc(1, sizeof(*e));
+        if(!e) {
+            free(bytes);
+            free(children);
+            return -1;
+        }
+        e->json = json_incref(json);
+        e->next = *slot;
+        *slot = e;
+        if(++cache->entries > cache->nbuckets)
+            grow(cache);
+    }
+    else if(!e->bytes)
+        cache->invalid--;
+    free(e->bytes);
+    e->bytes = bytes;
+    e->len = len;
+    e->flags = flags;
+    free(e->children);
+    e->children = children;
+    e->nchildren = nchildren;
+    if(add_parent(e, parent) || (parent && push_pending(cache, json)))
+        return -1;
+    return 0;
+}
@@ -0,0 +1,1195 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+#define error_set error_set__convert
+
+#define CONVERT_BUFFER_SIZE  65536
+
+typedef struct {
+    json_load_callback_t callback;
+    void *data;
+    size_t len;
+    size_t pos;
+    size_t position;  /* bytes consumed before buf */
+    int eof;
+    json_error_t *error;
+    unsigned char buf[CONVERT_BUFFER_SIZE];
+} input_t;
+
+typedef struct {
+    json_dump_callback_t callback;
+    void *data;
+    size_t len;
+    int failed;
+    char buf[CONVERT_BUFFER_SIZE];
+} output_t;
+
+typedef struct {
+    char *value;
+    size_t length;
+    size_t size;
+} strbuf_t;
+
+typedef struct {
+    int type;
+    int contained_type;
+    int pending;
+    int first;
+    json_int_t count;  /* -1 when unsized */
+} frame_t;
+
+typedef struct {
+    input_t input;
+    output_t output;
+    strbuf_t token;
+    size_t depth;
+    size_t stack_size;
+    frame_t *frames;
+    size_t flags;
+    json_error_t *error;
+} convert_t;
+
+static void error_set(convert_t *conv, const char *msg, ...)
+{
+    va_list ap;
+    size_t pos = conv->input.position + conv->input.pos;
+
+    if(!conv->error)
+        return;
+
+    va_start(ap, msg);
+    jsonp_error_vset(conv->error, -1, -1, pos, msg, ap);
+    va_end(ap);
+}
+
+/*** input ***/
+
+static int input_fill(input_t *in)
+{
+    if(in->eof)
+        return EOF;
+    in->position += in->len;
+    in->pos = 0;
+    in->len = in->callback(in->buf, sizeof(in->buf), in->data);
+    if(in->len == (size_t)-1)
+        jsonp_error_set(in->error, -1, -1, in->position, "read error");
+    if(in->len == 0 || in->len == (size_t)-1) {
+        in->len = 0;
+        in->eof = 1;
+        return EOF;
+    }
+    return in->buf[in->pos++];
+}
+
+static int input_get(input_t *in)
+{
+    if(in->pos < in->len)
+        return in->buf[in->pos++];
+    return input_fill(in);
+}
+
+static void input_unget(input_t *in, int c)
+{
+    if(c != EOF)
+        in->pos--;
+}
+
+/* Returns the number of bytes readable from in->buf without refilling */
+static size_t input_avail(input_t *in)
+{
+    if(in->pos == in->len && input_fill(in) != EOF)
+        in->pos--;
+    return in->len - in->pos;
+}
+
+/*** output ***/
+
+static int output_flush(output_t *out)
+{
+    if(out->len && !out->failed) {
+        if(out->callback(out->buf, out->len, out->data))
+            out->failed = 1;
+    }
+    out->len = 0;
+    return out->failed ? -1 : 0;
+}
+
+static int output_write(const char *buffer, size_t size, void *data)
+{
+    output_t *out = data;
+
+    if(out->len + size > sizeof(out->buf)) {
+        if(output_flush(out))
+            return -1;
+        if(size >= sizeof(out->buf)) {
+            if(out->callback(buffer, size, out->data))
+                out->failed = 1;
+            return out->failed ? -1 : 0;
+        }
+    }
+    memcpy(out->buf + out->len, buffer, size);
+    out->len += size;
+    return 0;
+}
+
+static int output_char(output_t *out, char c)
+{
+    if(out->len == sizeof(out->buf) && output_flush(out))
+        return -1;
+    out->buf[out->len++] = c;
+    return 0;
+}
+
+/*** shared ***/
+
+static int strbuf_append(strbuf_t *sb, const char *buf, size_t len)
+{
+    if(sb->length + len + 1 > sb->size) {
+        size_t size = sb->size ? sb->size : 64;
+        char *value;
+
+        while(size < sb->length + len + 1)
+            size *= 2;
+        value = realloc(sb->value, size);
+        if(!value)
+            return -1;
+        sb->value = value;
+        sb->size = size;
+    }
+    memcpy(sb->value + sb->length, buf, len);
+    sb->length += len;
+    sb->value[sb->length] = '\0';
+    return 0;
+}
+
+static int stack_push(convert_t *conv, int type)
+{
+    if(conv->depth >= UBJSONP_MAX_DEPTH) {
+        error_set(conv, "maximum nesting depth exceeded");
+        return -1;
+    }
+    if(conv->depth == conv->stack_size) {
+        size_t size = conv->stack_size ? conv->stack_size * 2 : 32;
+        frame_t *frames = realloc(conv->frames, size * sizeof(*frames));
+
+        if(!frames) {
+            error_set(conv, "out of memory");
+            return -1;
+        }
+        conv->frames = frames;
+        conv->stack_size = size;
+    }
+    memset(&conv->frames[conv->depth], 0, sizeof(conv->frames[0]));
+    conv->frames[conv->depth].type = type;
+    conv->frames[conv->depth].first = 1;
+    conv->frames[conv->depth].count = -1;
+    conv->depth++;
+    return 0;
+}
+
+/* Returns the length of the UTF-8 sequence started by u, or 0 if invalid */
+static size_t utf8_length(unsigned char u)
+{
+    if(u < 0x80)
+        return 1;
+    if(u >= 0xC2 && u <= 0xDF)
+        return 2;
+    if(u >= 0xE0 && u <= 0xEF)
+        return 3;
+    if(u >= 0xF0 && u <= 0xF4)
+        return 4;
+    return 0;
+}
+
+/* Checks that buf starts with a complete UTF-8 sequence; returns its length */
+static size_t utf8_check(const unsigned char *buf, size_t len)
+{
+    size_t count = utf8_length(buf[0]), i;
+    int32_t value;
+
+    if(count <= 1 || count > len)
+        return count == 1;
+    value = buf[0] & (0x7F >> count);
+    for(i = 1; i < count; i++) {
+        if((buf[i] & 0xC0) != 0x80)
+            return 0;
+        value = (value << 6) + (buf[i] & 0x3F);
+    }
+    if(value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF))
+        return 0;
+    if((count == 3 && value < 0x800) || (count == 4 && value < 0x10000))
+        return 0;
+    return count;
+}
+
+/*** JSON text -> UBJSON ***/
+
+#define TOKEN_INVALID  -1
+#define TOKEN_EOF       0
+#define TOKEN_STRING  256
+#define TOKEN_INTEGER 257
+#define TOKEN_REAL    258
+#define TOKEN_TRUE    259
+#define TOKEN_FALSE   260
+#define TOKEN_NULL    261
+
+static int lex_hex4(convert_t *conv, int32_t *out)
+{
+    int i, c;
+    int32_t value = 0;
+
+    for(i = 0; i < 4; i++) {
+        c = input_get(&conv->input);
+        value <<= 4;
+        if(c >= '0' && c <= '9')
+            value += c - '0';
+        else if(c >= 'a' && c <= 'f')
+            value += c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F')
+            value += c - 'A' + 10;
+        else {
+            error_set(conv, "invalid escape");
+            return -1;
+        }
+    }
+    *out = value;
+    return 0;
+}
+
+static int lex_encode_utf8(convert_t *conv, int32_t codepoint)
+{
+    char buf[4];
+    size_t len;
+
+    if(codepoint < 0x80) {
+        buf[0] = codepoint;
+        len = 1;
+    }
+    else if(codepoint < 0x800) {
+        buf[0] = 0xC0 + ((codepoint & 0x7C0) >> 6);
+        buf[1] = 0x80 + (codepoint & 0x03F);
+        len = 2;
+    }
+    else if(codepoint < 0x10000) {
+        buf[0] = 0xE0 + ((codepoint & 0xF000) >> 12);
+        buf[1] = 0x80 + ((codepoint & 0x0FC0) >> 6);
+        buf[2] = 0x80 + (codepoint & 0x003F);
+        len = 3;
+    }
+    else {
+        buf[0] = 0xF0 + ((codepoint & 0x1C0000) >> 18);
+        buf[1] = 0x80 + ((codepoint & 0x03F000) >> 12);
+        buf[2] = 0x80 + ((codepoint & 0x000FC0) >> 6);
+        buf[3] = 0x80 + (codepoint & 0x00003F);
+        len = 4;
+    }
+    return strbuf_append(&conv->token, buf, len);
+}
+
+static int lex_scan_string(convert_t *conv)
+{
+    input_t *in = &conv->input;
+    int c;
+    char ch;
+
+    conv->token.length = 0;
+    for(;;) {
+        /* copy runs of plain bytes straight out of the input buffer */
+        size_t start = in->pos;
+        while(in->pos < in->len) {
+            c = in->buf[in->pos];
+            if(c == '"' || c == '\\' || c < 0x20 || c >= 0x80)
+                break;
+            in->pos++;
+        }
+        if(in->pos > start &&
+           strbuf_append(&conv->token, (char *)in->buf + start, in->pos - start))
+            goto oom;
+
+        c = input_get(in);
+        if(c == EOF) {
+            error_set(conv, "premature end of input");
+            return TOKEN_INVALID;
+        }
+        if(c == '"')
+            return TOKEN_STRING;
+        if(c >= 0x20 && c < 0x80 && c != '\\') {
+            /* ran off the end of the input buffer */
+            ch = c;
+            if(strbuf_append(&conv->token, &ch, 1))
+                goto oom;
+            continue;
+        }
+        if(c < 0x20) {
+            error_set(conv, "control character 0x%x in string", c);
+            return TOKEN_INVALID;
+        }
+        if(c >= 0x80) {
+            unsigned char seq[4];
+            size_t i, count;
+
+            seq[0] = c;
+            count = utf8_length(c);
+            for(i = 1; i < count; i++) {
+                c = input_get(in);
+                if(c == EOF)
+                    break;
+                seq[i] = c;
+            }
+            if(!count || i < count || utf8_check(seq, count) != count) {
+                error_set(conv, "invalid UTF-8 in string");
+                return TOKEN_INVALID;
+            }
+            if(strbuf_append(&conv->token, (char *)seq, count))
+                goto oom;
+            continue;
+        }
+
+        /* escape */
+        c = input_get(in);
+        switch(c) {
+            case '"': case '\\': case '/':
+                break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'u': {
+                int32_t value, value2;
+
+                if(lex_hex4(conv, &value))
+                    return TOKEN_INVALID;
+                if(value >= 0xD800 && value <= 0xDBFF) {
+                    if(input_get(in) != '\\' || input_get(in) != 'u' ||
+                       lex_hex4(conv, &value2) ||
+                       value2 < 0xDC00 || value2 > 0xDFFF) {
+                        error_set(conv, "invalid Unicode surrogate pair");
+                        return TOKEN_INVALID;
+                    }
+                    value = ((value - 0xD800) << 10) + (value2 - 0xDC00) + 0x10000;
+                }
+                else if(value >= 0xDC00 && value <= 0xDFFF) {
+                    error_set(conv, "invalid Unicode '\\u%04X'", value);
+                    return TOKEN_INVALID;
+                }
+                else if(value == 0 && !(conv->flags & JSON_ALLOW_NUL)) {
+                    error_set(conv, "\\u0000 is not allowed without JSON_ALLOW_NUL");
+                    return TOKEN_INVALID;
+                }
+                if(lex_encode_utf8(conv, value))
+                    goto oom;
+                continue;
+            }
+            default:
+                error_set(conv, "invalid escape");
+                return TOKEN_INVALID;
+        }
+        ch = c;
+        if(strbuf_append(&conv->token, &ch, 1))
+            goto oom;
+    }
+
+oom:
+    error_set(conv, "out of memory");
+    return TOKEN_INVALID;
+}
+
+static int lex_digits(convert_t *conv)
+{
+    int c, n = 0;
+    char ch;
+
+    while((c = input_get(&conv->input)) >= '0' && c <= '9') {
+        ch = c;
+        if(strbuf_append(&conv->token, &ch, 1))
+            return -1;
+        n++;
+    }
+    input_unget(&conv->input, c);
+    return n;
+}
+
+static int lex_scan_number(convert_t *conv, int c)
+{
+    int token = TOKEN_INTEGER;
+    char ch;
+
+    conv->token.length = 0;
+    if(c == '-') {
+        if(strbuf_append(&conv->token, "-", 1))
+            goto oom;
+        c = input_get(&conv->input);
+    }
+    if(c == '0') {
+        if(strbuf_append(&conv->token, "0", 1))
+            goto oom;
+    }
+    else if(c >= '1' && c <= '9') {
+        input_unget(&conv->input, c);
+        if(lex_digits(conv) < 0)
+            goto oom;
+    }
+    else
+        goto invalid;
+
+    c = input_get(&conv->input);
+    if(c == '.') {
+        token = TOKEN_REAL;
+        if(strbuf_append(&conv->token, ".", 1))
+            goto oom;
+        switch(lex_digits(conv)) {
+            case -1: goto oom;
+            case 0: goto invalid;
+        }
+        c = input_get(&conv->input);
+    }
+    if(c == 'e' || c == 'E') {
+        token = TOKEN_REAL;
+        ch = c;
+        if(strbuf_append(&conv->token, &ch, 1))
+            goto oom;
+        c = input_get(&conv->input);
+        if(c == '+' || c == '-') {
+            ch = c;
+            if(strbuf_append(&conv->token, &ch, 1))
+                goto oom;
+        }
+        else
+            input_unget(&conv->input, c);
+        switch(lex_digits(conv)) {
+            case -1: goto oom;
+            case 0: goto invalid;
+        }
+        c = input_get(&conv->input);
+    }
+    input_unget(&conv->input, c);
+    return token;
+
+invalid:
+    error_set(conv, "invalid number");
+    return TOKEN_INVALID;
+oom:
+    error_set(conv, "out of memory");
+    return TOKEN_INVALID;
+}
+
+static int lex_scan_literal(convert_t *conv, const char *rest, int token)
+{
+    for(; *rest; rest++) {
+        if(input_get(&conv->input) != *rest) {
+            error_set(conv, "invalid token");
+            return TOKEN_INVALID;
+        }
+    }
+    return token;
+}
+
+static int lex_scan(convert_t *conv)
+{
+    int c;
+
+    do
+        c = input_get(&conv->input);
+    while(c == ' ' || c == '\t' || c == '\n' || c == '\r');
+
+    switch(c) {
+        case EOF:
+            return TOKEN_EOF;
+        case '{': case '}': case '[': case ']': case ':': case ',':
+            return c;
+        case '"':
+            return lex_scan_string(conv);
+        case 't':
+            return lex_scan_literal(conv, "rue", TOKEN_TRUE);
+        case 'f':
+            return lex_scan_literal(conv, "alse", TOKEN_FALSE);
+        case 'n':
+            return lex_scan_literal(conv, "ull", TOKEN_NULL);
+        default:
+            if(c == '-' || (c >= '0' && c <= '9'))
+                return lex_scan_number(conv, c);
+            error_set(conv, "invalid token");
+            return TOKEN_INVALID;
+    }
+}
+
+static int emit_json_number(convert_t *conv, int token)
+{
+    json_int_t value;
+    char *end;
+
+    if(token == TOKEN_INTEGER) {
+        errno = 0;
+        value = strtoll(conv->token.value, &end, 10);
+        if(errno != ERANGE)
+            return ubjsonp_dump_int(value, output_write, &conv->output);
+    }
+    /* reals and out-of-range integers keep their exact text */
+    return ubjsonp_dump_hpn(conv->token.value, conv->token.length, output_write, &conv->output);
+}
+
+#define EXPECT_VALUE  0
+#define EXPECT_KEY    1
+#define EXPECT_COLON  2
+#define EXPECT_SEP    3
+
+static int convert_from_json(convert_t *conv)
+{
+    int expect = EXPECT_VALUE;
+    int first = 0;
+    int token;
+    output_t *out = &conv->output;
+
+    token = lex_scan(conv);
+    if(!(conv->flags & JSON_DECODE_ANY) && token != '[' && token != '{') {
+        if(token != TOKEN_INVALID)
+            error_set(conv, "'[' or '{' expected");
+        return -1;
+    }
+
+    for(;; token = lex_scan(conv)) {
+        int top = conv->depth ? conv->frames[conv->depth - 1].type : 0;
+
+        if(token == TOKEN_INVALID)
+            return -1;
+        if(token == TOKEN_EOF) {
+            error_set(conv, "premature end of input");
+            return -1;
+        }
+
+        switch(expect) {
+            case EXPECT_KEY:
+                if(token == '}' && first)
+                    goto close;
+                if(token != TOKEN_STRING) {
+                    error_set(conv, "string or '}' expected");
+                    return -1;
+                }
+                if(ubjsonp_dump_buf(conv->token.value, conv->token.length, output_write, out))
+                    return -1;
+                expect = EXPECT_COLON;
+                continue;
+
+            case EXPECT_COLON:
+                if(token != ':') {
+                    error_set(conv, "':' expected");
+                    return -1;
+                }
+                expect = EXPECT_VALUE;
+                first = 0;
+                continue;
+
+            case EXPECT_SEP:
+                if(token == ',') {
+                    expect = (top == '[') ? EXPECT_VALUE : EXPECT_KEY;
+                    first = 0;
+                    continue;
+                }
+                if(token == (top == '[' ? ']' : '}'))
+                    goto close;
+                error_set(conv, "',' or '%c' expected", top == '[' ? ']' : '}');
+                return -1;
+        }
+
+        /* EXPECT_VALUE */
+        switch(token) {
+            case ']':
+                if(first && top == '[')
+                    goto close;
+                error_set(conv, "unexpected token");
+                return -1;
+            case '[': case '{':
+                if(stack_push(conv, token) || output_char(out, token))
+                    return -1;
+                expect = (token == '[') ? EXPECT_VALUE : EXPECT_KEY;
+                first = 1;
+                continue;
+            case TOKEN_STRING:
+                if(output_char(out, 'S') ||
+                   ubjsonp_dump_buf(conv->token.value, conv->token.length, output_write, out))
+                    return -1;
+                break;
+            case TOKEN_INTEGER: case TOKEN_REAL:
+                if(emit_json_number(conv, token))
+                    return -1;
+                break;
+            case TOKEN_TRUE:
+                if(output_char(out, 'T'))
+                    return -1;
+                break;
+            case TOKEN_FALSE:
+                if(output_char(out, 'F'))
+                    return -1;
+                break;
+            case TOKEN_NULL:
+                if(output_char(out, 'Z'))
+                    return -1;
+                break;
+            default:
+                error_set(conv, "unexpected token");
+                return -1;
+        }
+        goto value_done;
+
+close:
+        if(output_char(out, top == '[' ? ']' : '}'))
+            return -1;
+        conv->depth--;
+
+value_done:
+        if(!conv->depth)
+            break;
+        expect = EXPECT_SEP;
+    }
+
+    if(!(conv->flags & JSON_DISABLE_EOF_CHECK)) {
+        token = lex_scan(conv);
+        if(token != TOKEN_EOF) {
+            if(token != TOKEN_INVALID)
+                error_set(conv, "end of file expected");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*** UBJSON -> JSON text ***/
+
+static int read_int(convert_t *conv, int type, json_int_t *out)
+{
+    int sz, i, c;
+    uint64_t value = 0;
+
+    switch(type) {
+        case 'i': case 'U': sz = 1; break;
+        case 'I': sz = 2; break;
+        case 'l': sz = 4; break;
+        case 'L': sz = 8; break;
+        default:
+            error_set(conv, "unrecognized type");
+            return -1;
+    }
+    for(i = 0; i < sz; i++) {
+        c = input_get(&conv->input);
+        if(c == EOF) {
+            error_set(conv, "premature end of input");
+            return -1;
+        }
+        value = (value << 8) | c;
+    }
+    if(type != 'U' && sz < 8 && (value >> (sz * 8 - 1)))
+        value |= ~(uint64_t)0 << (sz * 8);
+    *out = (json_int_t)value;
+    return 0;
+}
+
+static int read_token(convert_t *conv, json_int_t len);
+
+/* Sizes may themselves be high-precision numbers, as load.c allows */
+static int read_any_size(convert_t *conv, int type, json_int_t *out, int depth)
+{
+    int r;
+
+    while(type == 'N' || !type)
+        type = input_get(&conv->input);
+    if(type == EOF) {
+        error_set(conv, "premature end of input");
+        return -1;
+    }
+    if(type == 'H') {
+        if(depth >= UBJSONP_MAX_DEPTH) {
+            error_set(conv, "maximum nesting depth exceeded");
+            return -1;
+        }
+        if(read_any_size(conv, 0, out, depth + 1) || read_token(conv, *out))
+            return -1;
+        r = ubjsonp_check_hpn(conv->token.value, conv->token.length, out);
+        if(r) {
+            error_set(conv, r < 0 ? "failed parsing high-precision number" : "non-integer size");
+            return -1;
+        }
+    }
+    else if(read_int(conv, type, out))
+        return -1;
+    if(*out < 0) {
+        error_set(conv, "negative size");
+        return -1;
+    }
+    return 0;
+}
+
+static int read_size(convert_t *conv, int type, json_int_t *out)
+{
+    return read_any_size(conv, type, out, 0);
+}
+
+static int read_float(convert_t *conv, int sz, double *out)
+{
+    unsigned char s[8];
+    int i, c;
+    uint64_t bits = 0;
+
+    for(i = 0; i < sz; i++) {
+        c = input_get(&conv->input);
+        if(c == EOF) {
+            error_set(conv, "premature end of input");
+            return -1;
+        }
+        s[i] = c;
+        bits = (bits << 8) | s[i];
+    }
+    if(sz == 4) {
+        uint32_t bits32 = bits;
+        float f;
+        memcpy(&f, &bits32, 4);
+        *out = f;
+    }
+    else
+        memcpy(out, &bits, 8);
+    return 0;
+}
+
+static int emit_escaped(convert_t *conv, const unsigned char *buf, size_t len)
+{
+    output_t *out = &conv->output;
+    size_t i, start = 0;
+
+    for(i = 0; i < len; i++) {
+        unsigned char c = buf[i];
+        const char *esc;
+        char tmp[8];
+
+        if(c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        if(i > start && output_write((char *)buf + start, i - start, out))
+            return -1;
+        switch(c) {
+            case '"': esc = "\\\""; break;
+            case '\\': esc = "\\\\"; break;
+            case '\b': esc = "\\b"; break;
+            case '\f': esc = "\\f"; break;
+            case '\n': esc = "\\n"; break;
+            case '\r': esc = "\\r"; break;
+            case '\t': esc = "\\t"; break;
+            default:
+                snprintf(tmp, sizeof(tmp), "\\u%04X", c);
+                esc = tmp;
+        }
+        if(output_write(esc, strlen(esc), out))
+            return -1;
+        start = i + 1;
+    }
+    if(i > start && output_write((char *)buf + start, i - start, out))
+        return -1;
+    return 0;
+}
+
+/* Streams a length-prefixed string body as a quoted JSON string */
+static int emit_string(convert_t *conv, json_int_t len)
+{
+    input_t *in = &conv->input;
+    unsigned char carry[4];
+    size_t ncarry = 0, need = 0;
+
+    if(output_char(&conv->output, '"'))
+        return -1;
+    while(len > 0) {
+        size_t chunk = input_avail(in), i, n;
+        const unsigned char *p = in->buf + in->pos;
+
+        if(!chunk) {
+            error_set(conv, "premature end of input");
+            return -1;
+        }
+        if((json_int_t)chunk > len)
+            chunk = len;
+        in->pos += chunk;
+        len -= chunk;
+
+        /* finish a multibyte sequence split across input chunks */
+        while(ncarry && chunk) {
+            carry[ncarry++] = *p++;
+            chunk--;
+            if(ncarry < need)
+                continue;
+            if(utf8_check(carry, ncarry) != ncarry) {
+                error_set(conv, "invalid UTF-8 in string");
+                return -1;
+            }
+            if(output_write((char *)carry, ncarry, &conv->output))
+                return -1;
+            ncarry = 0;
+        }
+
+        for(i = 0; i < chunk; i += n) {
+            if(p[i] < 0x80) {
+                n = 1;
+                continue;
+            }
+            n = utf8_check(p + i, chunk - i);
+            if(!n)
+                break;
+        }
+        if(emit_escaped(conv, p, i))
+            return -1;
+        if(i < chunk) {
+            need = utf8_length(p[i]);
+            ncarry = chunk - i;
+            if(!need || ncarry >= need || !len) {
+                error_set(conv, "invalid UTF-8 in string");
+                return -1;
+            }
+            memcpy(carry, p + i, ncarry);
+        }
+    }
+    if(ncarry) {
+        error_set(conv, "invalid UTF-8 in string");
+        return -1;
+    }
+    return output_char(&conv->output, '"');
+}
+
+/* Reads len bytes into conv->token */
+static int read_token(convert_t *conv, json_int_t len)
+{
+    input_t *in = &conv->input;
+
+    conv->token.length = 0;
+    while(len > 0) {
+        size_t chunk = input_avail(in);
+
+        if(!chunk) {
+            error_set(conv, "premature end of input");
+            return -1;
+        }
+        if((json_int_t)chunk > len)
+            chunk = len;
+        if(strbuf_append(&conv->token, (char *)in->buf + in->pos, chunk)) {
+            error_set(conv, "out of memory");
+            return -1;
+        }
+        in->pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Copies a high-precision number through once it is known to be valid JSON */
+static int emit_hpn(convert_t *conv, json_int_t len)
+{
+    if(read_token(conv, len))
+        return -1;
+    if(!ubjsonp_is_number(conv->token.value, conv->token.length)) {
+        error_set(conv, "failed parsing high-precision number");
+        return -1;
+    }
+    return output_write(conv->token.value, conv->token.length, &conv->output);
+}
+
+/* Reads a key into conv->token */
+static int read_key(convert_t *conv, int type)
+{
+    json_int_t len;
+
+    if(read_size(conv, type, &len) || read_token(conv, len))
+        return -1;
+    if(ubjsonp_utf8_valid((unsigned char *)conv->token.value, conv->token.length) != conv->token.length) {
+        error_set(conv, "invalid UTF-8 in object key");
+        return -1;
+    }
+    return 0;
+}
+
+static int emit_scalar(convert_t *conv, int type)
+{
+    output_t *out = &conv->output;
+    char buf[32];
+    json_int_t value;
+    double f;
+    int len;
+
+    switch(type) {
+        case 'Z':
+            return output_write("null", 4, out);
+        case 'T':
+            return output_write("true", 4, out);
+        case 'F':
+            return output_write("false", 5, out);
+        case 'i': case 'U': case 'I': case 'l': case 'L':
+            if(read_int(conv, type, &value))
+                return -1;
+            len = snprintf(buf, sizeof(buf), "%" JSON_INTEGER_FORMAT, value);
+            return output_write(buf, len, out);
+        case 'd': case 'D':
+            if(read_float(conv, type == 'd' ? 4 : 8, &f))
+                return -1;
+            if(isnan(f) || isinf(f)) {
+                error_set(conv, "real value cannot be represented in JSON");
+                return -1;
+            }
+            len = snprintf(buf, sizeof(buf), "%.17g", f);
+            if(!strpbrk(buf, ".eE"))
+                buf[len++] = '.', buf[len++] = '0';
+            return output_write(buf, len, out);
+        case 'C': {
+            int c = input_get(&conv->input);
+            unsigned char ch = c;
+
+            if(c == EOF) {
+                error_set(conv, "premature end of input");
+                return -1;
+            }
+            if(c >= 0x80) {
+                error_set(conv, "invalid UTF-8 in string");
+                return -1;
+            }
+            return output_char(out, '"') || emit_escaped(conv, &ch, 1) ||
+                   output_char(out, '"');
+        }
+        case 'S': case 'H':
+            if(read_size(conv, 0, &value))
+                return -1;
+            return (type == 'S') ? emit_string(conv, value) : emit_hpn(conv, value);
+        case EOF:
+            error_set(conv, "premature end of input");
+            return -1;
+        default:
+            error_set(conv, "unrecognized type");
+            return -1;
+    }
+}
+
+static int open_container(convert_t *conv, int type)
+{
+    frame_t *f;
+    int c;
+
+    if(stack_push(conv, type))
+        return -1;
+    f = &conv->frames[conv->depth - 1];
+
+    c = input_get(&conv->input);
+    if(c == '$') {
+        /* sole contained type */
+        f->contained_type = input_get(&conv->input);
+        c = input_get(&conv->input);
+        if(c != '#') {
+            error_set(conv, "container has type without count");
+            return -1;
+        }
+    }
+    if(c == '#') {
+        const char *msg;
+
+        if(read_size(conv, 0, &f->count))
+            return -1;
+        msg = ubjsonp_check_count(NULL, type, f->contained_type, f->count, 0, (size_t)-1);
+        if(msg) {
+            error_set(conv, "%s", msg);
+            return -1;
+        }
+        /* nothing but no-op elements, which take no input */
+        if(type == '[' && f->contained_type == 'N')
+            f->count = 0;
+    }
+    else
+        f->pending = c;
+
+    return output_char(&conv->output, type);
+}
+
+static int convert_to_json(convert_t *conv)
+{
+    output_t *out = &conv->output;
+    int type;
+
+    type = input_get(&conv->input);
+    while(type == 'N')
+        type = input_get(&conv->input);
+    if(!(conv->flags & JSON_DECODE_ANY) && type != '[' && type != '{') {
+        error_set(conv, "'[' or '{' expected");
+        return -1;
+    }
+
+    for(;;) {
+        if(conv->depth) {
+            frame_t *f = &conv->frames[conv->depth - 1];
+            int c = 0;
+
+            if(f->count == 0)
+                goto close;
+            if(f->count < 0) {
+                c = f->pending ? f->pending : input_get(&conv->input);
+                f->pending = 0;
+                if(c == (f->type == '[' ? ']' : '}'))
+                    goto close;
+                if(c == EOF) {
+                    error_set(conv, "premature end of input");
+                    return -1;
+                }
+            }
+            else
+                f->count--;
+
+            if(f->type == '{') {
+                if(read_key(conv, c))
+                    return -1;
+                c = 0;
+            }
+            if(f->contained_type)
+                type = f->contained_type;
+            else
+                type = c ? c : input_get(&conv->input);
+            if(type == 'N')
+                continue;
+
+            if(!f->first && output_char(out, ','))
+                return -1;
+            f->first = 0;
+            if(f->type == '{') {
+                if(output_char(out, '"') ||
+                   emit_escaped(conv, (unsigned char *)conv->token.value, conv->token.length) ||
+                   output_write("\":", 2, out))
+                    return -1;
+            }
+        }
+
+        if(type == '[' || type == '{') {
+            if(open_container(conv, type))
+                return -1;
+            continue;
+        }
+        if(emit_scalar(conv, type))
+            return -1;
+        goto value_done;
+
+close:
+        if(output_char(out, conv->frames[conv->depth - 1].type == '[' ? ']' : '}'))
+            return -1;
+        conv->depth--;
+
+value_done:
+        if(!conv->depth)
+            break;
+    }
+
+    if(!(conv->flags & JSON_DISABLE_EOF_CHECK)) {
+        if(input_get(&conv->input) != EOF) {
+            error_set(conv, "end of file expected");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*** entry points ***/
+
+static int convert(int (*func)(convert_t *), json_load_callback_t input, void *input_data,
+                   json_dump_callback_t output, void *output_data,
+                   size_t flags, json_error_t *error)
+{
+    convert_t *conv;
+    int ret;
+
+    if(!input || !output) {
+        jsonp_error_set(error, -1, -1, 0, "wrong arguments");
+        return -1;
+    }
+
+    conv = malloc(sizeof(*conv));
+    if(!conv) {
+        jsonp_error_set(error, -1, -1, 0, "out of memory");
+        return -1;
+    }
+    conv->input.callback = input;
+    conv->input.data = input_data;
+    conv->input.len = conv->input.pos = conv->input.position = 0;
+    conv->input.eof = 0;
+    conv->input.error = error;
+    conv->output.callback = output;
+    conv->output.data = output_data;
+    conv->output.len = 0;
+    conv->output.failed = 0;
+    conv->token.value = NULL;
+    conv->token.length = conv->token.size = 0;
+    conv->depth = conv->stack_size = 0;
+    conv->frames = NULL;
+    conv->flags = flags;
+    conv->error = error;
+
+    ret = func(conv);
+    if(output_flush(&conv->output))
+        ret = -1;
+    if(ret && conv->output.failed)
+        error_set(conv, "output callback failed");
+    if(ret && error && !error->text[0])
+        error_set(conv, "unknown error");
+
+    free(conv->token.value);
+    free(conv->frames);
+    free(conv);
+    return ret;
+}
+
+int ubjson_convert_from_json(json_load_callback_t input, void *input_data,
+                             json_dump_callback_t output, void *output_data,
+                             size_t flags, json_error_t *error)
+{
+    jsonp_error_init(error, "<callback>");
+    return convert(convert_from_json, input, input_data, output, output_data, flags, error);
+}
+
+int ubjson_convert_to_json(json_load_callback_t input, void *input_data,
+                           json_dump_callback_t output, void *output_data,
+                           size_t flags, json_error_t *error)
+{
+    jsonp_error_init(error, "<callback>");
+    return convert(convert_to_json, input, input_data, output, output_data, flags, error);
+}
+
+static size_t fread_callback(void *buffer, size_t buflen, void *data)
+{
+    size_t len = fread(buffer, 1, buflen, data);
+    return ferror((FILE *)data) ? (size_t)-1 : len;
+}
+
+static int fwrite_callback(const char *buffer, size_t size, void *data)
+{
+    return fwrite(buffer, size, 1, data) == 1 ? 0 : -1;
+}
+
+static int convertf(int (*func)(convert_t *), FILE *input, FILE *output,
+                    size_t flags, json_error_t *error)
+{
+    jsonp_error_init(error, input == stdin ? "<stdin>" : "<stream>");
+    if(!input || !output) {
+        jsonp_error_set(error, -1, -1, 0, "wrong arguments");
+        return -1;
+    }
+    return convert(func, fread_callback, input, fwrite_callback, output, flags, error);
+}
+
+int ubjson_convertf_from_json(FILE *input, FILE *output, size_t flags, json_error_t *error)
+{
+    return convertf(convert_from_json, input, output, flags, error);
+}
+
+int ubjson_convertf_to_json(FILE *input, FILE *output, size_t flags, json_error_t *error)
+{
+    return convertf(convert_to_json, input, output, flags, error);
+}
@@ -6,46 +6,76 @@
  * it under the terms of the MIT license. See LICENSE for details.
  */
 
+#include <locale.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <jansson.h>
 
 #include "ubjansson.h"
+#include "jansson_private.h"
 
-static int dump_ubjson_int(json_int_t num, json_dump_callback_t dump, void *data);
-
-static int dump_ubjson_buf(const void *buf, size_t bufsz, json_dump_callback_t dump, void *data)
+int ubjsonp_dump_buf(const void *buf, size_t bufsz, json_dump_callback_t dump, void *data)
 {
-    if(dump_ubjson_int(bufsz, dump, data))
+    if(ubjsonp_dump_int(bufsz, dump, data))
         return -1;
     if(dump(buf, bufsz, data))
         return -1;
     return 0;
 }
 
-static int dump_ubjson_hpn(json_t *json, json_dump_callback_t dump, void *data)
+int ubjsonp_dump_hpn(const char *text, size_t len, json_dump_callback_t dump, void *data)
 {
     if(dump("H", 1, data))
         return -1;
-    char *st = json_dumps(json, JSON_ENCODE_ANY);
-    int ret = dump_ubjson_buf(st, strlen(st), dump, data);
-    free(st);
-    return ret;
+    return ubjsonp_dump_buf(text, len, dump, data);
 }
 
-static int dump_ubjson_int(json_int_t num, json_dump_callback_t dump, void *data)
+/* Writes a real as the high-precision number json_dumps() would print */
+int ubjsonp_dump_real(double value, json_dump_callback_t dump, void *data)
 {
-    if(num < 0) {
-        json_t *json = json_integer(num);
-        if(dump_ubjson_hpn(json, dump, data))
-            return -1;
-        json_decref(json);
-        return 0;
+    char buf[32], *p, *digits;
+    const char *point = localeconv()->decimal_point;
+    int len;
+
+    if(!isfinite(value))
+        return -1;
+    len = snprintf(buf, sizeof(buf), "%.17g", value);
+    if(len < 0 || (size_t)len + 2 >= sizeof(buf))
+        return -1;
+
+    if(*point != '.' && (p = strchr(buf, *point)))
+        *p = '.';
+    if(!strchr(buf, '.') && !strchr(buf, 'e')) {
+        buf[len++] = '.';
+        buf[len++] = '0';
+        buf[len] = '\0';
     }
+    /* no plus sign or leading zeros in the exponent */
+    if((p = strchr(buf, 'e'))) {
+        digits = p + 1 + (p[1] == '-');
+        p += 2;
+        while(*p == '0')
+            ++p;
+        memmove(digits, p, strlen(p) + 1);
+        len = strlen(buf);
+    }
+    return ubjsonp_dump_hpn(buf, len, dump, data);
+}
 
+int ubjsonp_dump_int(json_int_t num, json_dump_callback_t dump, void *data)
+{
     unsigned char s[9];
     int i;
 
+    if(num < 0) {
+        char st[32];
+        int len = snprintf(st, sizeof(st), "%" JSON_INTEGER_FORMAT, num);
+        return ubjsonp_dump_hpn(st, len, dump, data);
+    }
+
     s[0] = 'L';
     for(i = 8; i > 0; --i) {
         s[i] = num & 0xff;
@@ -58,87 +88,160 @@ static int dump_ubjson_int(json_int_t num, json_dump_callback_t dump, void *data
     return 0;
 }
 
-static int dump_ubjson_value(json_t *json, size_t flags, int depth,
-                   json_dump_callback_t dump, void *data)
+static int dump_ubjson_value(json_t *json, json_t *parent, size_t flags, int depth,
+                   ubjson_cache_t *cache, json_dump_callback_t dump, void *data);
+
+static int compare_keys(const void *a, const void *b)
 {
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static int dump_ubjson_pair(const char *key, json_t *value, json_t *object, size_t flags, int depth,
+                   ubjson_cache_t *cache, json_dump_callback_t dump, void *data)
+{
+    if(ubjsonp_dump_buf(key, strlen(key), dump, data))
+        return -1;
+    return dump_ubjson_value(value, object, flags, depth + 1, cache, dump, data);
+}
+
+static int dump_ubjson_value(json_t *json, json_t *parent, size_t flags, int depth,
+                   ubjson_cache_t *cache, json_dump_callback_t dump, void *data)
+{
+    size_t start = 0;
+    int r;
+
+    if(cache && (json_is_object(json) || json_is_array(json))) {
+        r = ubjsonp_cache_emit(cache, json, parent, flags);
+        if(r)
+            return (r < 0) ? -1 : 0;
+        if(ubjsonp_cache_begin(cache, &start))
+            return -1;
+    }
+
     switch(json_typeof(json)) {
         case JSON_OBJECT: {
             const char *key;
             json_t *value;
             void *iter;
+            size_t size = json_object_size(json);
+
+            if(dump("{#", 2, data) || ubjsonp_dump_int(size, dump, data))
+                return -1;
 
-            dump("{#", 2, data);
-            dump_ubjson_int(json_object_size(json), dump, data);
+            if(flags & JSON_SORT_KEYS) {
+                const char **keys;
+                size_t i = 0;
+
+                keys = malloc((size ? size : 1) * sizeof(const char *));
+                if(!keys)
+                    return -1;
+                for (iter = json_object_iter(json); iter; iter = json_object_iter_next(json, iter))
+                    keys[i++] = json_object_iter_key(iter);
+                qsort(keys, size, sizeof(const char *), compare_keys);
+
+                for (i = 0; i < size; ++i)
+                {
+                    value = json_object_get(json, keys[i]);
+                    if(dump_ubjson_pair(keys[i], value, json, flags, depth, cache, dump, data)) {
+                        free(keys);
+                        return -1;
+                    }
+                }
+                free(keys);
+                break;
+            }
 
             for (iter = json_object_iter(json); iter; iter = json_object_iter_next(json, iter))
             {
                 key = json_object_iter_key(iter);
                 value = json_object_iter_value(iter);
 
-                if(dump_ubjson_buf(key, strlen(key), dump, data))
-                    return -1;
-                if(dump_ubjson_value(value, flags, depth + 1, dump, data))
+                if(dump_ubjson_pair(key, value, json, flags, depth, cache, dump, data))
                     return -1;
             }
-            return 0;
+            break;
         }
         case JSON_ARRAY: {
             json_t *elem;
             size_t i;
             size_t count = json_array_size(json);
 
-            dump("[#", 2, data);
-            dump_ubjson_int(count, dump, data);
+            if(dump("[#", 2, data) || ubjsonp_dump_int(count, dump, data))
+                return -1;
 
             for (i = 0; i < count; ++i)
             {
                 elem = json_array_get(json, i);
-                if(dump_ubjson_value(elem, flags, depth + 1, dump, data))
+                if(dump_ubjson_value(elem, json, flags, depth + 1, cache, dump, data))
                     return -1;
             }
-            return 0;
+            break;
         }
         case JSON_STRING: {
             const char *st = json_string_value(json);
             if(dump("S", 1, data))
                 return -1;
-            if(dump_ubjson_buf(st, strlen(st), dump, data))
+            if(ubjsonp_dump_buf(st, json_string_length(json), dump, data))
                 return -1;
             return 0;
         }
         case JSON_INTEGER:
-            return dump_ubjson_int(json_integer_value(json), dump, data);
+            return ubjsonp_dump_int(json_integer_value(json), dump, data);
         case JSON_REAL:
-            return dump_ubjson_hpn(json, dump, data);
+            return ubjsonp_dump_real(json_real_value(json), dump, data);
         case JSON_TRUE:
             return dump("T", 1, data);
         case JSON_FALSE:
             return dump("F", 1, data);
         case JSON_NULL:
             return dump("Z", 1, data);
+        default:
+            return -1;
     }
-    return -1;
+
+    if(cache)
+        return ubjsonp_cache_end(cache, json, parent, flags, start);
+    return 0;
 }
 
-int ubjson_dump_callback(json_t *json, json_dump_callback_t callback, void *data, size_t flags)
+int ubjson_dump_callback_opts(json_t *json, json_dump_callback_t callback, void *data, size_t flags, const ubjson_dump_opts_t *opts)
 {
+    ubjson_cache_t *cache = opts ? opts->cache : NULL;
+    ubjson_digest_t *digest = opts ? opts->digest : NULL;
+    ubjsonp_hasher_t hasher;
+
     if(!(flags & JSON_ENCODE_ANY)) {
         if(!json_is_array(json) && !json_is_object(json))
            return -1;
     }
 
-    return dump_ubjson_value(json, flags, 0, callback, data);
+    /* the hasher sits outside the cache so cached bytes are digested too */
+    if(digest) {
+        ubjsonp_hasher_init(&hasher, digest->flags, callback, data);
+        callback = ubjsonp_hasher_callback;
+        data = &hasher;
+    }
+    if(cache) {
+        ubjsonp_cache_attach(cache, callback, data);
+        callback = ubjsonp_cache_callback;
+        data = cache;
+    }
+
+    if(dump_ubjson_value(json, NULL, flags, 0, cache, callback, data))
+        return -1;
+    if(digest)
+        ubjsonp_hasher_final(&hasher, digest);
+    return 0;
 }
 
-struct dumpb_data {
-    unsigned char *p;
-    size_t rem;
-    size_t sz;
-};
+int ubjson_dump_callback(json_t *json, json_dump_callback_t callback, void *data, size_t flags)
+{
+    return ubjson_dump_callback_opts(json, callback, data, flags, NULL);
+}
 
-static int dumpb_callback(const char *buffer, size_t size, void *datap)
+int ubjsonp_dumpb_callback(const char *buffer, size_t size, void *datap)
 {
-    struct dumpb_data *data = datap;
+    struct ubjsonp_dumpb_data *data = datap;
     if(data->rem) {
         size_t copysz = (data->rem < size) ? data->rem : size;
         memcpy(data->p, buffer, copysz);
@@ -149,16 +252,21 @@ static int dumpb_callback(const char *buffer, size_t size, void *datap)
     return 0;
 }
 
-ssize_t ubjson_dumpb(json_t *json, void *buffer, size_t buflen, size_t flags)
+ssize_t ubjson_dumpb_opts(json_t *json, void *buffer, size_t buflen, size_t flags, const ubjson_dump_opts_t *opts)
 {
-    struct dumpb_data data;
+    struct ubjsonp_dumpb_data data;
 
     data.p = buffer;
     data.rem = buflen;
     data.sz = 0;
 
-    if (ubjson_dump_callback(json, dumpb_callback, &data, flags))
+    if (ubjson_dump_callback_opts(json, ubjsonp_dumpb_callback, &data, flags, opts))
         return -1;
 
     return data.sz;
 }
+
+ssize_t ubjson_dumpb(json_t *json, void *buffer, size_t buflen, size_t flags)
+{
+    return ubjson_dumpb_opts(json, buffer, buflen, flags, NULL);
+}
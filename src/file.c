@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h>
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+struct ubjson_mapping {
+    ubjsonp_map_t map;
+};
+
+ubjson_mapping_t *ubjson_mapping_open(const char *path, json_error_t *error)
+{
+    ubjson_mapping_t *mapping;
+
+    jsonp_error_init(error, path);
+
+    if(!path) {
+        jsonp_error_set(error, -1, -1, 0, "wrong arguments");
+        return NULL;
+    }
+
+    mapping = malloc(sizeof(*mapping));
+    if(!mapping) {
+        jsonp_error_set(error, -1, -1, 0, "out of memory");
+        return NULL;
+    }
+    if(ubjsonp_map_file(path, &mapping->map, UBJSONP_MAP_SEQUENTIAL, error)) {
+        free(mapping);
+        return NULL;
+    }
+    return mapping;
+}
+
+const void *ubjson_mapping_data(const ubjson_mapping_t *mapping, size_t *len)
+{
+    if(len)
+        *len = mapping->map.len;
+    return mapping->map.data;
+}
+
+void ubjson_mapping_close(ubjson_mapping_t *mapping)
+{
+    if(!mapping)
+        return;
+    ubjsonp_unmap_file(&mapping->map);
+    free(mapping);
+}
+
+json_t *ubjson_load_file_opts(const char *path, size_t flags, const ubjson_load_opts_t *opts, json_error_t *error)
+{
+    ubjsonp_map_t map;
+    json_t *result;
+
+    jsonp_error_init(error, path);
+
+    if(!path) {
+        jsonp_error_set(error, -1, -1, 0, "wrong arguments");
+        return NULL;
+    }
+
+    if(ubjsonp_map_file(path, &map, UBJSONP_MAP_SEQUENTIAL, error))
+        return NULL;
+    result = ubjson_loadb_opts(map.data, map.len, flags, opts, error);
+    ubjsonp_unmap_file(&map);
+
+    if(!result)
+        jsonp_error_set_source(error, path);
+    return result;
+}
+
+json_t *ubjson_load_file(const char *path, size_t flags, json_error_t *error)
+{
+    return ubjson_load_file_opts(path, flags, NULL, error);
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/*
+ * Digests of encoded output, fed from the dump callback: XXH64 (seed 0)
+ * and optionally SHA-256.  Both buffer partial blocks so the tiny writes
+ * of the encoder cost a memcpy each.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+#define PRIME64_1  UINT64_C(0x9E3779B185EBCA87)
+#define PRIME64_2  UINT64_C(0xC2B2AE3D27D4EB4F)
+#define PRIME64_3  UINT64_C(0x165667B19E3779F9)
+#define PRIME64_4  UINT64_C(0x85EBCA77C2B2AE63)
+#define PRIME64_5  UINT64_C(0x27D4EB2F165667C5)
+
+#define rotl64(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
+#define rotr32(x, r)  (((x) >> (r)) | ((x) << (32 - (r))))
+
+static uint64_t get_le64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for(i = 7; i >= 0; --i)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static void xxh64_init(ubjsonp_xxh64_t *s)
+{
+    s->v[0] = PRIME64_1 + PRIME64_2;
+    s->v[1] = PRIME64_2;
+    s->v[2] = 0;
+    s->v[3] = 0 - PRIME64_1;
+    s->total = 0;
+    s->buflen = 0;
+}
+
+static void xxh64_stripe(ubjsonp_xxh64_t *s, const unsigned char *p)
+{
+    s->v[0] = xxh64_round(s->v[0], get_le64(p));
+    s->v[1] = xxh64_round(s->v[1], get_le64(p + 8));
+    s->v[2] = xxh64_round(s->v[2], get_le64(p + 16));
+    s->v[3] = xxh64_round(s->v[3], get_le64(p + 24));
+}
+
+static void xxh64_update(ubjsonp_xxh64_t *s, const unsigned char *p, size_t len)
+{
+    s->total += len;
+
+    if(s->buflen) {
+        size_t n = 32 - s->buflen;
+        if(n > len)
+            n = len;
+        memcpy(s->buf + s->buflen, p, n);
+        s->buflen += n;
+        p += n;
+        len -= n;
+        if(s->buflen < 32)
+            return;
+        xxh64_stripe(s, s->buf);
+        s->buflen = 0;
+    }
+    for(; len >= 32; p += 32, len -= 32)
+        xxh64_stripe(s, p);
+    memcpy(s->buf, p, len);
+    s->buflen = len;
+}
+
+static uint64_t xxh64_final(const ubjsonp_xxh64_t *s)
+{
+    const unsigned char *p = s->buf, *end = s->buf + s->buflen;
+    uint64_t h;
+
+    if(s->total >= 32) {
+        h = rotl64(s->v[0], 1) + rotl64(s->v[1], 7) + rotl64(s->v[2], 12) + rotl64(s->v[3], 18);
+        h = xxh64_merge(h, s->v[0]);
+        h = xxh64_merge(h, s->v[1]);
+        h = xxh64_merge(h, s->v[2]);
+        h = xxh64_merge(h, s->v[3]);
+    }
+    else
+        h = s->v[2] + PRIME64_5;
+    h += s->total;
+
+    for(; end - p >= 8; p += 8) {
+        h ^= xxh64_round(0, get_le64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if(end - p >= 4) {
+        h ^= (uint64_t)get_le32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for(; p < end; ++p) {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static void sha256_init(ubjsonp_sha256_t *s)
+{
+    static const uint32_t h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(s->h, h0, sizeof(h0));
+    s->total = 0;
+    s->buflen = 0;
+}
+
+static void sha256_block(ubjsonp_sha256_t *s, const unsigned char *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for(i = 0; i < 16; ++i)
+        w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+               ((uint32_t)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+    for(; i < 64; ++i) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+    e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+    for(i = 0; i < 64; ++i) {
+        t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void sha256_update(ubjsonp_sha256_t *s, const unsigned char *p, size_t len)
+{
+    s->total += len;
+
+    if(s->buflen) {
+        size_t n = 64 - s->buflen;
+        if(n > len)
+            n = len;
+        memcpy(s->buf + s->buflen, p, n);
+        s->buflen += n;
+        p += n;
+        len -= n;
+        if(s->buflen < 64)
+            return;
+        sha256_block(s, s->buf);
+        s->buflen = 0;
+    }
+    for(; len >= 64; p += 64, len -= 64)
+        sha256_block(s, p);
+    memcpy(s->buf, p, len);
+    s->buflen = len;
+}
+
+static void sha256_final(ubjsonp_sha256_t *s, unsigned char *out)
+{
+    uint64_t bits = s->total * 8;
+    unsigned char pad[72];
+    size_t padlen = (s->buflen < 56) ? 56 - s->buflen : 120 - s->buflen;
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for(i = 0; i < 8; ++i)
+        pad[padlen + i] = (unsigned char)(bits >> (56 - i * 8));
+    sha256_update(s, pad, padlen + 8);
+
+    for(i = 0; i < 32; ++i)
+        out[i] = (unsigned char)(s->h[i / 4] >> (24 - (i % 4) * 8));
+}
+
+void ubjsonp_hasher_init(ubjsonp_hasher_t *hasher, int flags, json_dump_callback_t dump, void *data)
+{
+    xxh64_init(&hasher->xxh64);
+    if(flags & UBJSON_DIGEST_SHA256)
+        sha256_init(&hasher->sha256);
+    hasher->flags = flags;
+    hasher->dump = dump;
+    hasher->data = data;
+}
+
+int ubjsonp_hasher_callback(const char *buffer, size_t size, void *data)
+{
+    ubjsonp_hasher_t *hasher = data;
+
+    xxh64_update(&hasher->xxh64, (const unsigned char *)buffer, size);
+    if(hasher->flags & UBJSON_DIGEST_SHA256)
+        sha256_update(&hasher->sha256, (const unsigned char *)buffer, size);
+    return hasher->dump ? hasher->dump(buffer, size, hasher->data) : 0;
+}
+
+void ubjsonp_hasher_final(ubjsonp_hasher_t *hasher, struct ubjson_digest *digest)
+{
+    digest->xxh64 = xxh64_final(&hasher->xxh64);
+    if(hasher->flags & UBJSON_DIGEST_SHA256)
+        sha256_final(&hasher->sha256, digest->sha256);
+}
+
+void ubjson_digest_buffer(const void *buffer, size_t buflen, ubjson_digest_t *digest)
+{
+    ubjsonp_hasher_t hasher;
+
+    ubjsonp_hasher_init(&hasher, digest->flags, NULL, NULL);
+    ubjsonp_hasher_callback(buffer, buflen, &hasher);
+    ubjsonp_hasher_final(&hasher, digest);
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+#define DEFAULT_MAX_ENTRIES  4096
+#define DEFAULT_MAX_LENGTH   64
+
+typedef struct {
+    size_t hash;
+    json_t *string;
+} slot_t;
+
+/* Open addressing with linear probing; entries are never removed, and
+   once max_entries strings are held further strings are not interned */
+struct ubjson_intern {
+    slot_t *slots;
+    size_t mask;
+    size_t max_entries;
+    size_t max_length;
+    size_t entries;
+    size_t hits;
+    size_t misses;
+};
+
+static size_t hash_str(const char *str, size_t len)
+{
+    size_t hash = 2166136261U;
+    size_t i;
+
+    for(i = 0; i < len; ++i)
+        hash = (hash ^ (unsigned char)str[i]) * 16777619U;
+    return hash;
+}
+
+ubjson_intern_t *ubjson_intern_new(size_t max_entries, size_t max_length)
+{
+    ubjson_intern_t *intern;
+    size_t size = 8;
+
+    if(!max_entries)
+        max_entries = DEFAULT_MAX_ENTRIES;
+    if(!max_length)
+        max_length = DEFAULT_MAX_LENGTH;
+
+    /* keep the table at most half full */
+    while(size / 2 < max_entries) {
+        if(size > ((size_t)-1 / sizeof(slot_t)) / 2)
+            return NULL;
+        size *= 2;
+    }
+
+    intern = malloc(sizeof(*intern));
+    if(!intern)
+        return NULL;
+    intern->slots = calloc(size, sizeof(slot_t));
+    if(!intern->slots) {
+        free(intern);
+        return NULL;
+    }
+    intern->mask = size - 1;
+    intern->max_entries = max_entries;
+    intern->max_length = max_length;
+    intern->entries = 0;
+    intern->hits = 0;
+    intern->misses = 0;
+    return intern;
+}
+
+void ubjson_intern_free(ubjson_intern_t *intern)
+{
+    size_t i;
+
+    if(!intern)
+        return;
+    for(i = 0; i <= intern->mask; ++i)
+        json_decref(intern->slots[i].string);
+    free(intern->slots);
+    free(intern);
+}
+
+void ubjson_intern_stats(const ubjson_intern_t *intern, size_t *hits, size_t *misses, size_t *entries)
+{
+    if(hits)
+        *hits = intern->hits;
+    if(misses)
+        *misses = intern->misses;
+    if(entries)
+        *entries = intern->entries;
+}
+
+json_t *ubjsonp_intern_string(ubjson_intern_t *intern, const char *str, size_t len)
+{
+    size_t hash, i;
+    slot_t *slot;
+    json_t *string;
+
+    if(len > intern->max_length)
+        return json_stringn(str, len);
+
+    hash = hash_str(str, len);
+    for(i = hash & intern->mask; ; i = (i + 1) & intern->mask) {
+        slot = &intern->slots[i];
+        if(!slot->string)
+            break;
+        if(slot->hash == hash && json_string_length(slot->string) == len &&
+           !memcmp(json_string_value(slot->string), str, len)) {
+            intern->hits++;
+            return json_incref(slot->string);
+        }
+    }
+
+    intern->misses++;
+    string = json_stringn(str, len);
+    if(string && intern->entries < intern->max_entries) {
+        slot->hash = hash;
+        slot->string = json_incref(string);
+        intern->entries++;
+    }
+    return string;
+}
@@ -9,6 +9,7 @@
 #define JANSSON_PRIVATE_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "jansson.h"
 
 void jsonp_error_init(json_error_t *error, const char *source);
@@ -18,6 +19,138 @@ void jsonp_error_set(json_error_t *error, int line, int column,
 void jsonp_error_vset(json_error_t *error, int line, int column,
                       size_t position, const char *msg, va_list ap);
 
+/* UBJSON encoding primitives shared between encoders */
+int ubjsonp_dump_int(json_int_t num, json_dump_callback_t dump, void *data);
+int ubjsonp_dump_buf(const void *buf, size_t bufsz, json_dump_callback_t dump, void *data);
+int ubjsonp_dump_hpn(const char *text, size_t len, json_dump_callback_t dump, void *data);
+int ubjsonp_dump_real(double value, json_dump_callback_t dump, void *data);
+
+/* Callback for writing into a fixed buffer; sz counts what would have been written */
+struct ubjsonp_dumpb_data {
+    unsigned char *p;
+    size_t rem;
+    size_t sz;
+};
+
+int ubjsonp_dumpb_callback(const char *buffer, size_t size, void *data);
+
+/* Read-only file mappings, falling back to malloc+read without mmap */
+#define UBJSONP_MAP_NORMAL      0
+#define UBJSONP_MAP_SEQUENTIAL  1
+#define UBJSONP_MAP_RANDOM      2
+
+typedef struct {
+    void *data;
+    size_t len;
+    int mapped;
+} ubjsonp_map_t;
+
+int ubjsonp_map_file(const char *path, ubjsonp_map_t *map, int advice, json_error_t *error);
+void ubjsonp_unmap_file(ubjsonp_map_t *map);
+
+/* Scanning encoded UBJSON in memory (scan.c) */
+#define UBJSONP_MAX_DEPTH  2048
+/* Elements of zero-width types cost no input, so without a max_count
+   limit their count is bounded by this */
+#define UBJSONP_MAX_ZERO_WIDTH_COUNT  0x100000
+
+typedef struct {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+    json_error_t *error;
+    const char *context;  /* prefixed to error messages when set */
+    size_t max_hpn_length;  /* for lengths given as high-precision numbers; 0 for none */
+} ubjsonp_scan_t;
+
+struct ubjson_limits;
+
+typedef struct {
+    int type;            /* '[' or '{' */
+    int contained_type;  /* 0 unless the container uses '$' */
+    json_int_t count;    /* elements left, or -1 if unsized */
+} ubjsonp_container_t;
+
+void ubjsonp_scan_init(ubjsonp_scan_t *s, const void *data, size_t len, json_error_t *error);
+int ubjsonp_scan_error(ubjsonp_scan_t *s, const char *msg);
+int ubjsonp_scan_byte(ubjsonp_scan_t *s);
+int ubjsonp_scan_marker(ubjsonp_scan_t *s);
+int ubjsonp_scan_int(ubjsonp_scan_t *s, int type, json_int_t *out);
+int ubjsonp_scan_size(ubjsonp_scan_t *s, json_int_t *out);
+int ubjsonp_scan_string(ubjsonp_scan_t *s, const char **str, size_t *len);
+int ubjsonp_scan_open(ubjsonp_scan_t *s, int type, ubjsonp_container_t *c,
+                      const struct ubjson_limits *limits, size_t nodes);
+int ubjsonp_scan_next(ubjsonp_scan_t *s, ubjsonp_container_t *c, const char **key, size_t *keylen, int *type);
+int ubjsonp_scan_skip(ubjsonp_scan_t *s, int type);
+
+int ubjsonp_type_size(int type);
+int ubjsonp_int_fits(int type, json_int_t value);
+int ubjsonp_int_marker(json_int_t value);
+json_int_t ubjsonp_get_int(const unsigned char *p, int type);
+void ubjsonp_put_int(unsigned char *p, int type, json_int_t value);
+double ubjsonp_get_real(const unsigned char *p, int type);
+void ubjsonp_put_real(unsigned char *p, int type, double value);
+void ubjsonp_copy_be(void *dst, const void *src, int width, size_t count);
+
+/* Native C numbers of UBJSON_TYPE_* types (typed.c) */
+json_int_t ubjsonp_get_native_int(const void *src, int type);
+int ubjsonp_scan_number(ubjsonp_scan_t *s, int ctype, int type, void *dst);
+int ubjsonp_scan_typed_array(ubjsonp_scan_t *s, int ctype, void *dst, size_t capacity, size_t *count);
+
+/* Whether p is a JSON number, as json_loads() requires of high-precision numbers */
+int ubjsonp_is_number(const char *p, size_t len);
+/* The number, or NULL if str is not one */
+json_t *ubjsonp_load_hpn(const char *str, size_t len);
+/* 0 for an integer, stored in *ival; 1 for a real; -1 if str is not a number */
+int ubjsonp_check_hpn(const char *str, size_t len, json_int_t *ival);
+
+/* Shared by load.c and validate.c so both accept the same counts */
+const char *ubjsonp_check_count(const struct ubjson_limits *limits, int type, int contained_type,
+                                json_int_t count, size_t nodes, size_t avail);
+
+/* Returns the length of the longest valid UTF-8 prefix of str */
+size_t ubjsonp_utf8_valid(const unsigned char *str, size_t len);
+
+/* Returns a new reference to a string, shared through the table when short */
+struct ubjson_intern;
+json_t *ubjsonp_intern_string(struct ubjson_intern *intern, const char *str, size_t len);
+
+/* Encode cache (cache.c); while attached it wraps the output callback */
+struct ubjson_cache;
+void ubjsonp_cache_attach(struct ubjson_cache *cache, json_dump_callback_t dump, void *data);
+int ubjsonp_cache_callback(const char *buffer, size_t size, void *data);
+int ubjsonp_cache_emit(struct ubjson_cache *cache, json_t *json, json_t *parent, size_t flags);
+int ubjsonp_cache_begin(struct ubjson_cache *cache, size_t *start);
+int ubjsonp_cache_end(struct ubjson_cache *cache, json_t *json, json_t *parent, size_t flags, size_t start);
+
+/* Digest of dump output (hash.c); the callback forwards to dump when set */
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buf[32];
+    size_t buflen;
+} ubjsonp_xxh64_t;
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t total;
+    unsigned char buf[64];
+    size_t buflen;
+} ubjsonp_sha256_t;
+
+typedef struct {
+    ubjsonp_xxh64_t xxh64;
+    ubjsonp_sha256_t sha256;
+    int flags;
+    json_dump_callback_t dump;
+    void *data;
+} ubjsonp_hasher_t;
+
+struct ubjson_digest;
+void ubjsonp_hasher_init(ubjsonp_hasher_t *hasher, int flags, json_dump_callback_t dump, void *data);
+int ubjsonp_hasher_callback(const char *buffer, size_t size, void *data);
+void ubjsonp_hasher_final(ubjsonp_hasher_t *hasher, struct ubjson_digest *digest);
+
 /* Windows compatibility */
 #ifdef _WIN32
 #define snprintf _snprintf
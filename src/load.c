@@ -7,6 +7,7 @@
  */
 
 #include <math.h>
+#include <string.h>
 
 #include <jansson.h>
 
@@ -14,19 +15,42 @@
 #include "jansson_private.h"
 
 #define error_set error_set__ubjson
-#define buffer_get buffer_get__ubjson
 
-static void error_set(json_error_t *error, const void *dummy,
-                      const char *msg, ...)
+/* Strings read from a stream are buffered in chunks of at most this size,
+   so a bogus length costs no more memory than the input actually holds */
+#define STREAM_STR_CHUNK  0x10000
+
+/* Type argument meaning the marker has not been read yet */
+#define NO_MARKER  (-2)
+
+typedef int (*getchar_func_t)(void *);
+
+typedef struct {
+    getchar_func_t getchar_func;
+    void *getchar_arg;
+    const unsigned char *buffer;  /* whole input when loading from memory */
+    size_t buflen;
+    size_t pos;
+    size_t flags;
+    const ubjson_limits_t *limits;
+    ubjson_intern_t *intern;
+    size_t depth;
+    size_t size_depth;  /* high-precision numbers nested in lengths */
+    size_t nodes;
+    json_error_t *error;
+} parser_t;
+
+#define limit(p, name)  ((p)->limits ? (p)->limits->name : 0)
+
+static void error_set(parser_t *parser, const char *msg, ...)
 {
     va_list ap;
     char msg_text[JSON_ERROR_TEXT_LENGTH];
 
     int line = -1, col = -1;
-    size_t pos = 0;
     const char *result = msg_text;
 
-    if(!error)
+    if(!parser->error)
         return;
 
     va_start(ap, msg);
@@ -34,16 +58,29 @@ static void error_set(json_error_t *error, const void *dummy,
     msg_text[JSON_ERROR_TEXT_LENGTH - 1] = '\0';
     va_end(ap);
 
-    jsonp_error_set(error, line, col, pos, "%s", result);
+    jsonp_error_set(parser->error, line, col, parser->pos, "%s", result);
 }
 
-typedef int (*getchar_func_t)(void *);
+static int parser_getc(parser_t *parser)
+{
+    int c;
+
+    if(parser->buffer) {
+        if(parser->pos >= parser->buflen)
+            return EOF;
+        return parser->buffer[parser->pos++];
+    }
+    c = parser->getchar_func(parser->getchar_arg);
+    if(c != EOF)
+        parser->pos++;
+    return c;
+}
 
 #define PUIF_UNSIGNED  0
 #define PUIF_SIGNED    1
 #define PUIF_CHAR      2
 
-static json_t *parse_ubjson_int(getchar_func_t getchar_func, void *getchar_arg, size_t flags, json_error_t *error, int sz, unsigned puif_flags)
+static json_t *parse_ubjson_int(parser_t *parser, int sz, unsigned puif_flags)
 {
     unsigned char s[8];
     int c;
@@ -54,9 +91,9 @@ static json_t *parse_ubjson_int(getchar_func_t getchar_func, void *getchar_arg,
     json_int_t val = 0;
 
     for(i = 0; i < sz; ++i) {
-        c = getchar_func(getchar_arg);
+        c = parser_getc(parser);
         if(c == EOF) {
-            error_set(error, NULL, "premature end of input");
+            error_set(parser, "premature end of input");
             return NULL;
         }
         if(i == 0 && (puif_flags & PUIF_SIGNED) && (c & 0x80))
@@ -98,7 +135,7 @@ static json_t *parse_ubjson_int(getchar_func_t getchar_func, void *getchar_arg,
     return json_integer(val);
 }
 
-static json_t *parse_ubjson_float(getchar_func_t getchar_func, void *getchar_arg, size_t flags, json_error_t *error, int sz)
+static json_t *parse_ubjson_float(parser_t *parser, int sz)
 {
     unsigned char s[8];
     int c;
@@ -107,14 +144,20 @@ static json_t *parse_ubjson_float(getchar_func_t getchar_func, void *getchar_arg
     double f = 0;
 
     for(i = 0; i < sz; ++i) {
-        c = getchar_func(getchar_arg);
+        c = parser_getc(parser);
         if(c == EOF) {
-            error_set(error, NULL, "premature end of input");
+            error_set(parser, "premature end of input");
             return NULL;
         }
         s[i] = c;
     }
 
+    /* infinities and NaNs have no JSON representation */
+    if(!isfinite(ubjsonp_get_real(s, (sz == 4) ? 'd' : 'D'))) {
+        error_set(parser, "invalid real number");
+        return NULL;
+    }
+
     if(sz == 4) {
         exponent = (((s[0] & 0x7F) << 1) | (s[1] >> 7)) - 127 - 23;
         s[1] |= 0x80;
@@ -137,58 +180,120 @@ static json_t *parse_ubjson_float(getchar_func_t getchar_func, void *getchar_arg
     return json_real(f);
 }
 
-static json_t *parse_ubjson_value(getchar_func_t getchar_func, void *getchar_arg, size_t flags, json_error_t *error, int type);
+static json_t *parse_ubjson_value(parser_t *parser, int type);
 
-static int parse_ubjson_any_size(getchar_func_t getchar_func, void *getchar_arg, size_t flags, json_error_t *error, int type, json_int_t *out)
+static int parse_ubjson_any_size(parser_t *parser, int type, json_int_t *out)
 {
     json_int_t i;
-    json_t *jlen = parse_ubjson_value(getchar_func, getchar_arg, flags, error, type);
+    json_t *jlen;
+
+    while(type == 'N' || type == NO_MARKER)
+        type = parser_getc(parser);
+    if(type == 'H') {
+        if(parser->size_depth >= UBJSONP_MAX_DEPTH) {
+            error_set(parser, "maximum nesting depth exceeded");
+            return 0;
+        }
+        parser->size_depth++;
+        jlen = parse_ubjson_value(parser, type);
+        parser->size_depth--;
+    }
+    else
+        jlen = parse_ubjson_value(parser, type);
     if(!json_is_integer(jlen)) {
         json_decref(jlen);
-        error_set(error, NULL, "non-integer size");
+        error_set(parser, "non-integer size");
         return 0;
     }
     i = json_integer_value(jlen);
     json_decref(jlen);
     if(i < 0) {
-        error_set(error, NULL, "negative size");
+        error_set(parser, "negative size");
         return 0;
     }
     *out = i;
     return 1;
 }
 
-static char *parse_ubjson_str(getchar_func_t getchar_func, void *getchar_arg, size_t flags, json_error_t *error, int type)
+static char *parse_ubjson_str(parser_t *parser, int type, size_t *outlen)
 {
-    char *buf;
+    char *buf, *tmp;
     int c;
-    int i;
+    size_t i, alloc;
     json_int_t len;
+    size_t max = limit(parser, max_string_length);
 
-    if(!parse_ubjson_any_size(getchar_func, getchar_arg, flags, error, type, &len))
+    if(!parse_ubjson_any_size(parser, type, &len))
         return NULL;
-    buf = malloc(len + 1);
-    for(i = 0; i < len; ++i)
+    if(max && (unsigned long long)len > max) {
+        error_set(parser, "string too long");
+        return NULL;
+    }
+
+    if(parser->buffer) {
+        /* the whole string must already be in the buffer */
+        if((unsigned long long)len > parser->buflen - parser->pos) {
+            error_set(parser, "premature end of input");
+            return NULL;
+        }
+        buf = malloc(len + 1);
+        if(!buf)
+            return NULL;
+        memcpy(buf, parser->buffer + parser->pos, len);
+        parser->pos += len;
+        buf[len] = '\0';
+        *outlen = len;
+        return buf;
+    }
+
+    alloc = ((unsigned long long)len < STREAM_STR_CHUNK) ? (size_t)len + 1 : STREAM_STR_CHUNK;
+    buf = malloc(alloc);
+    if(!buf)
+        return NULL;
+    for(i = 0; i < (size_t)len; ++i)
     {
-        c = getchar_func(getchar_arg);
+        if(i + 1 == alloc) {
+            alloc = ((unsigned long long)len - i < alloc) ? (size_t)len + 1 : alloc * 2;
+            tmp = realloc(buf, alloc);
+            if(!tmp) {
+                free(buf);
+                return NULL;
+            }
+            buf = tmp;
+        }
+        c = parser_getc(parser);
         if(c == EOF) {
             free(buf);
-            error_set(error, NULL, "premature end of input");
+            error_set(parser, "premature end of input");
             return NULL;
         }
         buf[i] = c;
     }
     buf[len] = '\0';
+    *outlen = len;
     return buf;
 }
 
-static json_t *parse_ubjson_value(getchar_func_t getchar_func, void *getchar_arg, size_t flags, json_error_t *error, int type)
+static int check_count(parser_t *parser, int type, int contained_type, json_int_t count)
 {
-    while (type == 'N' || !type)
-        type = getchar_func(getchar_arg);
+    size_t avail = parser->buffer ? parser->buflen - parser->pos : (size_t)-1;
+    const char *msg;
+
+    msg = ubjsonp_check_count(parser->limits, type, contained_type, count, parser->nodes, avail);
+    if(msg) {
+        error_set(parser, "%s", msg);
+        return -1;
+    }
+    return 0;
+}
+
+static json_t *parse_ubjson_value(parser_t *parser, int type)
+{
+    while (type == 'N' || type == NO_MARKER)
+        type = parser_getc(parser);
     switch (type) {
         case EOF: {
-            error_set(error, NULL, "premature end of input");
+            error_set(parser, "premature end of input");
             return NULL;
         }
         case 'Z':
@@ -198,41 +303,45 @@ static json_t *parse_ubjson_value(getchar_func_t getchar_func, void *getchar_arg
         case 'F':
             return json_false();
         case 'i':
-            return parse_ubjson_int(getchar_func, getchar_arg, flags, error, 1, PUIF_SIGNED);
+            return parse_ubjson_int(parser, 1, PUIF_SIGNED);
         case 'U':
-            return parse_ubjson_int(getchar_func, getchar_arg, flags, error, 1, PUIF_UNSIGNED);
+            return parse_ubjson_int(parser, 1, PUIF_UNSIGNED);
         case 'I':
-            return parse_ubjson_int(getchar_func, getchar_arg, flags, error, 2, PUIF_SIGNED);
+            return parse_ubjson_int(parser, 2, PUIF_SIGNED);
         case 'l':
-            return parse_ubjson_int(getchar_func, getchar_arg, flags, error, 4, PUIF_SIGNED);
+            return parse_ubjson_int(parser, 4, PUIF_SIGNED);
         case 'L':
-            return parse_ubjson_int(getchar_func, getchar_arg, flags, error, 8, PUIF_SIGNED);
+            return parse_ubjson_int(parser, 8, PUIF_SIGNED);
         case 'C':
-            return parse_ubjson_int(getchar_func, getchar_arg, flags, error, 1, PUIF_UNSIGNED | PUIF_CHAR);
+            return parse_ubjson_int(parser, 1, PUIF_UNSIGNED | PUIF_CHAR);
         case 'd':
-            return parse_ubjson_float(getchar_func, getchar_arg, flags, error, 4);
+            return parse_ubjson_float(parser, 4);
         case 'D':
-            return parse_ubjson_float(getchar_func, getchar_arg, flags, error, 8);
+            return parse_ubjson_float(parser, 8);
         case 'H': case 'S': {
             char *buf;
+            size_t len;
             json_t *ret;
 
-            buf = parse_ubjson_str(getchar_func, getchar_arg, flags, error, 0);
+            buf = parse_ubjson_str(parser, NO_MARKER, &len);
             if(!buf)
                 return NULL;
 
             if(type == 'H')
             {
-                ret = json_loads(buf, JSON_DECODE_ANY, error);
+                ret = ubjsonp_load_hpn(buf, len);
                 free(buf);
-                if(!(ret && json_is_number(ret))) {
-                    error_set(error, NULL, "failed parsing high-precision number");
+                if(!ret) {
+                    error_set(parser, "failed parsing high-precision number");
                     return NULL;
                 }
             }
             else
             {
-                ret = json_string(buf);
+                if(parser->intern)
+                    ret = ubjsonp_intern_string(parser->intern, buf, len);
+                else
+                    ret = json_stringn(buf, len);
                 free(buf);
             }
             return ret;
@@ -247,36 +356,58 @@ static json_t *parse_ubjson_value(getchar_func_t getchar_func, void *getchar_arg
             json_t *elem;
             json_t *container;
             char *key = NULL;
+            size_t keylen = 0;
+            size_t max_depth = limit(parser, max_depth);
+            size_t max_count = limit(parser, max_count);
+            size_t max_nodes = limit(parser, max_nodes);
+
+            if(parser->depth >= UBJSONP_MAX_DEPTH || (max_depth && parser->depth >= max_depth)) {
+                error_set(parser, "maximum nesting depth exceeded");
+                return NULL;
+            }
 
-            c = getchar_func(getchar_arg);
+            c = parser_getc(parser);
             if(c == '$') {
                 /* sole contained type */
-                contained_type = getchar_func(getchar_arg);
-                c = getchar_func(getchar_arg);
+                contained_type = parser_getc(parser);
+                c = parser_getc(parser);
                 if(c != '#') {
-                    error_set(error, NULL, "container has type without count");
+                    error_set(parser, "container has type without count");
                     return NULL;
                 }
             }
             if(c == '#') {
                 /* fixed item count */
-                if(!parse_ubjson_any_size(getchar_func, getchar_arg, flags, error, 0, &count))
+                if(!parse_ubjson_any_size(parser, NO_MARKER, &count))
                     return NULL;
-                c = 0;
+                if(check_count(parser, type, contained_type, count))
+                    return NULL;
+                c = NO_MARKER;
+                if(type == '[' && contained_type == 'N') {
+                    /* nothing to read or store */
+                    parser->nodes += count;
+                    count = 0;
+                }
             }
             container = (type == '[') ? json_array() : json_object();
             if(!container)
                 return NULL;
+            parser->depth++;
             for(i = 0; (count == -1) || (i < count); ++i) {
                 if(count == -1) {
-                    if(!c)
-                        c = getchar_func(getchar_arg);
+                    if(c == NO_MARKER)
+                        c = parser_getc(parser);
                     if(c == ((type == '[') ? ']' : '}'))
                         break;
+                    if(max_count && (unsigned long long)i >= max_count) {
+                        error_set(parser, "too many items");
+                        json_decref(container);
+                        return NULL;
+                    }
                 }
                 if(type == '{') {
-                    key = parse_ubjson_str(getchar_func, getchar_arg, flags, error, c);
-                    c = 0;
+                    key = parse_ubjson_str(parser, c, &keylen);
+                    c = NO_MARKER;
                     if(!key) {
                         json_decref(container);
                         return NULL;
@@ -286,15 +417,27 @@ static json_t *parse_ubjson_value(getchar_func_t getchar_func, void *getchar_arg
                     elem_type = contained_type;
                 else
                 {
-                    elem_type = c ? c : getchar_func(getchar_arg);
-                    c = 0;
+                    elem_type = (c != NO_MARKER) ? c : parser_getc(parser);
+                    c = NO_MARKER;
+                }
+                if(max_nodes && parser->nodes >= max_nodes) {
+                    error_set(parser, "too many values");
+                    free(key);
+                    json_decref(container);
+                    return NULL;
                 }
+                parser->nodes++;
                 if (elem_type == 'N')
                 {
                     free(key);
                     continue;
                 }
-                elem = parse_ubjson_value(getchar_func, getchar_arg, flags, error, elem_type);
+                if(key && memchr(key, '\0', keylen)) {
+                    error_set(parser, "NUL byte in object key not supported");
+                    elem = NULL;
+                }
+                else
+                    elem = parse_ubjson_value(parser, elem_type);
                 if (!elem)
                     j = 1;
                 else if (type == '[')
@@ -307,40 +450,41 @@ static json_t *parse_ubjson_value(getchar_func_t getchar_func, void *getchar_arg
                     return NULL;
                 }
             }
+            parser->depth--;
             return container;
         }
         default: {
-            error_set(error, NULL, "unrecognized type");
+            error_set(parser, "unrecognized type");
             return NULL;
         }
     }
 }
 
-static json_t *parse_ubjson(const void *getchar_func_p, void *getchar_arg, size_t flags, json_error_t *error)
+static json_t *parse_ubjson(parser_t *parser)
 {
-    getchar_func_t getchar_func = getchar_func_p;
-    int type = 0;
+    int type = NO_MARKER;
     json_t *result;
 
-    if(!(flags & JSON_DECODE_ANY)) {
-        type = getchar_func(getchar_arg);
+    if(!(parser->flags & JSON_DECODE_ANY)) {
+        type = parser_getc(parser);
         if(type != '[' && type != '{') {
-            error_set(error, NULL, "'[' or '{' expected");
+            error_set(parser, "'[' or '{' expected");
             return NULL;
         }
     }
 
-    result = parse_ubjson_value(getchar_func, getchar_arg, flags, error, type);
+    parser->nodes = 1;
+    result = parse_ubjson_value(parser, type);
 
     if(!result) {
-        if (!error->text[0])
-            error_set(error, NULL, "unknown error");
+        if (parser->error && !parser->error->text[0])
+            error_set(parser, "unknown error");
         return NULL;
     }
 
-    if(!(flags & JSON_DISABLE_EOF_CHECK)) {
-        if(getchar_func(getchar_arg) != EOF) {
-            error_set(error, NULL, "end of file expected");
+    if(!(parser->flags & JSON_DISABLE_EOF_CHECK)) {
+        if(parser_getc(parser) != EOF) {
+            error_set(parser, "end of file expected");
             json_decref(result);
             return NULL;
         }
@@ -349,49 +493,49 @@ static json_t *parse_ubjson(const void *getchar_func_p, void *getchar_arg, size_
     return result;
 }
 
-typedef struct
+static int file_get(void *data)
 {
-    const char *data;
-    size_t len;
-    size_t pos;
-} buffer_data_t;
+    return fgetc(data);
+}
 
-static int buffer_get(void *data)
+static void parser_init(parser_t *parser, size_t flags, const ubjson_load_opts_t *opts, json_error_t *error)
 {
-    char c;
-    buffer_data_t *stream = data;
-    if(stream->pos >= stream->len)
-      return EOF;
-
-    c = stream->data[stream->pos];
-    stream->pos++;
-    return (unsigned char)c;
+    memset(parser, 0, sizeof(*parser));
+    parser->flags = flags;
+    if(opts) {
+        parser->limits = opts->limits;
+        parser->intern = opts->intern;
+    }
+    parser->error = error;
 }
 
-json_t *ubjson_loadb(void *buffer, size_t buflen, size_t flags, json_error_t *error)
+json_t *ubjson_loadb_opts(void *buffer, size_t buflen, size_t flags, const ubjson_load_opts_t *opts, json_error_t *error)
 {
-    json_t *result;
-    buffer_data_t stream_data;
+    parser_t parser;
 
     jsonp_error_init(error, "<buffer>");
+    parser_init(&parser, flags, opts, error);
 
     if (buffer == NULL) {
-        error_set(error, NULL, "wrong arguments");
+        error_set(&parser, "wrong arguments");
         return NULL;
     }
 
-    stream_data.data = buffer;
-    stream_data.pos = 0;
-    stream_data.len = buflen;
+    parser.buffer = buffer;
+    parser.buflen = buflen;
 
-    result = parse_ubjson(buffer_get, &stream_data, flags, error);
-    return result;
+    return parse_ubjson(&parser);
 }
 
-json_t *ubjson_loadf(FILE *input, size_t flags, json_error_t *error)
+json_t *ubjson_loadb(void *buffer, size_t buflen, size_t flags, json_error_t *error)
+{
+    return ubjson_loadb_opts(buffer, buflen, flags, NULL, error);
+}
+
+json_t *ubjson_loadf_opts(FILE *input, size_t flags, const ubjson_load_opts_t *opts, json_error_t *error)
 {
     const char *source;
-    json_t *result;
+    parser_t parser;
 
     if(input == stdin)
         source = "<stdin>";
@@ -399,12 +543,20 @@ json_t *ubjson_loadf(FILE *input, size_t flags, json_error_t *error)
         source = "<stream>";
 
     jsonp_error_init(error, source);
+    parser_init(&parser, flags, opts, error);
 
     if (input == NULL) {
-        error_set(error, NULL, "wrong arguments");
+        error_set(&parser, "wrong arguments");
         return NULL;
     }
 
-    result = parse_ubjson(fgetc, input, flags, error);
-    return result;
+    parser.getchar_func = file_get;
+    parser.getchar_arg = input;
+
+    return parse_ubjson(&parser);
+}
+
+json_t *ubjson_loadf(FILE *input, size_t flags, json_error_t *error)
+{
+    return ubjson_loadf_opts(input, flags, NULL, error);
 }
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#include "jansson_private.h"
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#define USE_MMAP 1
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+static int map_read(int fd, ubjsonp_map_t *map)
+{
+    size_t done = 0;
+    char *data = malloc(map->len ? map->len : 1);
+
+    if(!data)
+        return -1;
+    while(done < map->len) {
+        ssize_t n = read(fd, data + done, map->len - done);
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR)
+                continue;
+            free(data);
+            if(n == 0)
+                errno = EIO;
+            return -1;
+        }
+        done += n;
+    }
+    map->data = data;
+    map->mapped = 0;
+    return 0;
+}
+
+int ubjsonp_map_file(const char *path, ubjsonp_map_t *map, int advice, json_error_t *error)
+{
+    struct stat st;
+    int fd;
+
+    map->data = NULL;
+    map->len = 0;
+    map->mapped = 0;
+
+    fd = open(path, O_RDONLY | O_BINARY);
+    if(fd < 0) {
+        jsonp_error_set(error, -1, -1, 0, "unable to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    if(fstat(fd, &st)) {
+        jsonp_error_set(error, -1, -1, 0, "unable to stat %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if((unsigned long long)st.st_size > (size_t)-1) {
+        jsonp_error_set(error, -1, -1, 0, "%s is too large to map", path);
+        close(fd);
+        return -1;
+    }
+    map->len = st.st_size;
+
+#ifdef USE_MMAP
+    if(map->len) {
+        void *data = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED) {
+#ifdef HAVE_MADVISE
+            if(advice == UBJSONP_MAP_SEQUENTIAL)
+                madvise(data, map->len, MADV_SEQUENTIAL);
+            else if(advice == UBJSONP_MAP_RANDOM)
+                madvise(data, map->len, MADV_RANDOM);
+#endif
+            map->data = data;
+            map->mapped = 1;
+            close(fd);
+            return 0;
+        }
+    }
+#endif
+    (void)advice;
+
+    if(map_read(fd, map)) {
+        jsonp_error_set(error, -1, -1, 0, "unable to read %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+void ubjsonp_unmap_file(ubjsonp_map_t *map)
+{
+#ifdef USE_MMAP
+    if(map->mapped)
+        munmap(map->data, map->len);
+    else
+#endif
+        free(map->data);
+    map->data = NULL;
+    map->len = 0;
+    map->mapped = 0;
+}
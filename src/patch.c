@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <string.h>
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+typedef struct {
+    size_t start;  /* first byte of the value, including its marker */
+    size_t end;
+    int type;
+    int typed;     /* inside a '$' container, so there is no marker */
+} target_t;
+
+/* Only "~0" and "~1" are valid escapes in a reference token */
+static int token_valid(const char *tok, size_t toklen)
+{
+    size_t j;
+
+    for(j = 0; j < toklen; ++j) {
+        if(tok[j] != '~')
+            continue;
+        if(j + 1 >= toklen || (tok[j + 1] != '0' && tok[j + 1] != '1'))
+            return 0;
+        ++j;
+    }
+    return 1;
+}
+
+/* Compares an object key with a valid JSON Pointer reference token */
+static int token_equals(const char *key, size_t keylen, const char *tok, size_t toklen)
+{
+    size_t i, j;
+
+    for(i = j = 0; j < toklen; ++i, ++j) {
+        char c = tok[j];
+
+        if(c == '~') {
+            c = (tok[j + 1] == '1') ? '/' : '~';
+            ++j;
+        }
+        if(i >= keylen || key[i] != c)
+            return 0;
+    }
+    return i == keylen;
+}
+
+static int token_index(const char *tok, size_t toklen, json_int_t *index)
+{
+    size_t i;
+
+    if(!toklen || toklen > 18 || (tok[0] == '0' && toklen > 1))
+        return -1;
+    *index = 0;
+    for(i = 0; i < toklen; ++i) {
+        if(tok[i] < '0' || tok[i] > '9')
+            return -1;
+        *index = (*index * 10) + (tok[i] - '0');
+    }
+    return 0;
+}
+
+static int locate(ubjsonp_scan_t *s, const char *path, target_t *t)
+{
+    t->typed = 0;
+    t->type = ubjsonp_scan_marker(s);
+    t->start = s->pos - 1;
+
+    while(*path) {
+        ubjsonp_container_t c;
+        const char *tok = path + 1, *key = NULL;
+        size_t toklen, keylen = 0;
+        json_int_t index = 0, i;
+        int r, sz;
+
+        if(*path != '/')
+            return ubjsonp_scan_error(s, "invalid path");
+        toklen = strcspn(tok, "/");
+        path = tok + toklen;
+        if(!token_valid(tok, toklen))
+            return ubjsonp_scan_error(s, "invalid path");
+
+        if(t->type != '[' && t->type != '{')
+            return ubjsonp_scan_error(s, "path not found");
+        if(t->type == '[' && token_index(tok, toklen, &index))
+            return ubjsonp_scan_error(s, "invalid array index in path");
+        if(ubjsonp_scan_open(s, t->type, &c, NULL, 0))
+            return -1;
+        sz = (c.type == '[' && c.contained_type != 'N') ? ubjsonp_type_size(c.contained_type) : -1;
+        if(sz >= 0) {
+            /* fixed-size elements: compute where the element is */
+            if(index >= c.count)
+                return ubjsonp_scan_error(s, "path not found");
+            if(sz && (unsigned long long)index > (s->len - s->pos) / sz)
+                return ubjsonp_scan_error(s, "premature end of input");
+            s->pos += index * sz;
+            t->type = c.contained_type;
+        }
+        else {
+            for(i = 0; ; ++i) {
+                r = ubjsonp_scan_next(s, &c, &key, &keylen, &t->type);
+                if(r < 0)
+                    return -1;
+                if(r == 0)
+                    return ubjsonp_scan_error(s, "path not found");
+                if(c.type == '[' ? (i == index) : token_equals(key, keylen, tok, toklen))
+                    break;
+                if(ubjsonp_scan_skip(s, t->type))
+                    return -1;
+            }
+        }
+        t->typed = (c.contained_type != 0);
+        t->start = s->pos - (t->typed ? 0 : 1);
+    }
+
+    if(t->type == EOF)
+        return ubjsonp_scan_error(s, "premature end of input");
+    if(ubjsonp_scan_skip(s, t->type))
+        return -1;
+    t->end = s->pos;
+    return 0;
+}
+
+/*
+ * Chooses how to encode value in place of the target.  The head (marker
+ * and fixed-size payload or string length) goes into head; string bytes
+ * are returned through body.
+ */
+static int encode(ubjsonp_scan_t *s, const target_t *t, json_t *value,
+                  unsigned char *head, size_t *headlen, const char **body, size_t *bodylen)
+{
+    const unsigned char *old = s->data + t->start;
+    unsigned char *p = head;
+    int type = t->type;
+
+    *headlen = 0;
+    *body = NULL;
+    *bodylen = 0;
+
+    if(type == '[' || type == '{')
+        return ubjsonp_scan_error(s, "only scalar values can be patched");
+
+    switch(json_typeof(value)) {
+        case JSON_NULL:
+            type = 'Z';
+            break;
+        case JSON_TRUE:
+            type = 'T';
+            break;
+        case JSON_FALSE:
+            type = 'F';
+            break;
+        case JSON_INTEGER: {
+            json_int_t v = json_integer_value(value);
+            if(!ubjsonp_int_fits(type, v)) {
+                if(t->typed)
+                    goto mismatch;
+                type = ubjsonp_int_marker(v);
+            }
+            if(!t->typed)
+                *p++ = type;
+            ubjsonp_put_int(p, type, v);
+            p += ubjsonp_type_size(type);
+            *headlen = p - head;
+            return 0;
+        }
+        case JSON_REAL: {
+            double v = json_real_value(value);
+            if(type != 'D' && !(type == 'd' && (double)(float)v == v)) {
+                if(t->typed)
+                    goto mismatch;
+                type = 'D';
+            }
+            if(!t->typed)
+                *p++ = type;
+            ubjsonp_put_real(p, type, v);
+            p += ubjsonp_type_size(type);
+            *headlen = p - head;
+            return 0;
+        }
+        case JSON_STRING: {
+            const char *str = json_string_value(value);
+            size_t len = json_string_length(value);
+            int size_type = 0;
+
+            if(len == 1 && (unsigned char)str[0] < 0x80 && type == 'C') {
+                if(!t->typed)
+                    *p++ = 'C';
+                *p++ = str[0];
+                *headlen = p - head;
+                return 0;
+            }
+            if(type == 'S') {
+                /* keep the old length marker when it is wide enough */
+                size_type = old[t->typed ? 0 : 1];
+                if(!ubjsonp_int_fits(size_type, len))
+                    size_type = 0;
+            }
+            else if(t->typed)
+                goto mismatch;
+            if(!size_type)
+                size_type = ubjsonp_int_marker(len);
+            if(!t->typed)
+                *p++ = 'S';
+            *p++ = size_type;
+            ubjsonp_put_int(p, size_type, len);
+            p += ubjsonp_type_size(size_type);
+            *headlen = p - head;
+            *body = str;
+            *bodylen = len;
+            return 0;
+        }
+        default:
+            return ubjsonp_scan_error(s, "only scalar values can be patched");
+    }
+
+    /* null and booleans */
+    if(t->typed) {
+        if(type != t->type)
+            goto mismatch;
+        *headlen = 0;
+        return 0;
+    }
+    head[0] = type;
+    *headlen = 1;
+    return 0;
+
+mismatch:
+    return ubjsonp_scan_error(s, "value does not fit the container type");
+}
+
+ssize_t ubjson_patch(void *buffer, size_t buflen, size_t bufsize, const char *path,
+                     json_t *value, json_error_t *error)
+{
+    ubjsonp_scan_t s;
+    target_t t;
+    unsigned char head[16];
+    const char *body;
+    size_t headlen, bodylen, newlen, oldlen;
+    unsigned char *buf = buffer;
+
+    jsonp_error_init(error, "<buffer>");
+
+    if(!buffer || !path || !value || bufsize < buflen) {
+        jsonp_error_set(error, -1, -1, 0, "wrong arguments");
+        return -1;
+    }
+
+    ubjsonp_scan_init(&s, buffer, buflen, error);
+    if(locate(&s, path, &t))
+        return -1;
+    s.pos = t.start;
+    if(encode(&s, &t, value, head, &headlen, &body, &bodylen))
+        return -1;
+
+    oldlen = t.end - t.start;
+    newlen = headlen + bodylen;
+    if(newlen != oldlen) {
+        if(newlen > oldlen && newlen - oldlen > bufsize - buflen)
+            return ubjsonp_scan_error(&s, "buffer too small");
+        /* splice: shift everything after the old value once */
+        memmove(buf + t.start + newlen, buf + t.end, buflen - t.end);
+        buflen = buflen - oldlen + newlen;
+    }
+    memcpy(buf + t.start, head, headlen);
+    if(bodylen)
+        memcpy(buf + t.start + headlen, body, bodylen);
+    return buflen;
+}
@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/*
+ * A record file is a sequence of UBJSON records followed by an index:
+ *
+ *   record 0 .. record N-1
+ *   offsets:   N+1 big-endian uint64 record start offsets; the last one is
+ *              the end of the record data
+ *   summaries: UBJSON {"block_size": B, "blocks": [{"first": i,
+ *              "min": key, "max": key}, ...]} for every block of B
+ *              records that had keys appended with it
+ *   trailer:   uint64 N, uint64 offsets position, uint64 summaries
+ *              position, 8 byte magic
+ *
+ * All integers in the index are big-endian.
+ *
+ * Appending to an existing file stages the new records in a temporary
+ * file and copies them over the old index only when the writer is
+ * closed, so until then the file stays as it was.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+#define RECFILE_MAGIC         "UBJREC1\n"
+#define RECFILE_TRAILER_SIZE  32
+
+struct ubjson_recfile {
+    ubjsonp_map_t map;
+    const unsigned char *offsets;
+    size_t count;
+    size_t index_pos;
+    size_t block_size;
+    json_t *blocks;
+};
+
+struct ubjson_recfile_writer {
+    FILE *file;
+    FILE *stage;    /* records appended to an existing file, or NULL */
+    uint64_t base;  /* where the staged records go in the file */
+    uint64_t pos;
+    uint64_t end;  /* end of the last complete record */
+    uint64_t *offsets;
+    size_t count;
+    size_t size;
+    size_t block_size;
+    json_t *blocks;
+    char *min_key;
+    char *max_key;
+    int failed;
+};
+
+static uint64_t get_be64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    int i;
+
+    for(i = 0; i < 8; ++i)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+    int i;
+
+    for(i = 7; i >= 0; --i) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+/*** reader ***/
+
+ubjson_recfile_t *ubjson_recfile_open(const char *path, json_error_t *error)
+{
+    ubjson_recfile_t *recfile;
+    const unsigned char *trailer;
+    uint64_t count, index_pos, summary_pos, summary_end;
+    json_t *summaries, *block_size;
+
+    jsonp_error_init(error, path);
+
+    if(!path) {
+        jsonp_error_set(error, -1, -1, 0, "wrong arguments");
+        return NULL;
+    }
+
+    recfile = malloc(sizeof(*recfile));
+    if(!recfile) {
+        jsonp_error_set(error, -1, -1, 0, "out of memory");
+        return NULL;
+    }
+    recfile->blocks = NULL;
+    if(ubjsonp_map_file(path, &recfile->map, UBJSONP_MAP_RANDOM, error)) {
+        free(recfile);
+        return NULL;
+    }
+
+    if(recfile->map.len < RECFILE_TRAILER_SIZE)
+        goto invalid;
+    summary_end = recfile->map.len - RECFILE_TRAILER_SIZE;
+    trailer = (const unsigned char *)recfile->map.data + summary_end;
+    if(memcmp(trailer + 24, RECFILE_MAGIC, 8))
+        goto invalid;
+    count = get_be64(trailer);
+    index_pos = get_be64(trailer + 8);
+    summary_pos = get_be64(trailer + 16);
+    if(summary_pos > summary_end || index_pos > summary_pos ||
+       count >= (summary_pos - index_pos) / 8 ||
+       (count + 1) * 8 != summary_pos - index_pos)
+        goto invalid;
+
+    recfile->offsets = (const unsigned char *)recfile->map.data + index_pos;
+    recfile->count = count;
+    recfile->index_pos = index_pos;
+
+    summaries = ubjson_loadb((char *)recfile->map.data + summary_pos,
+                             summary_end - summary_pos, 0, error);
+    if(!summaries) {
+        ubjson_recfile_close(recfile);
+        return NULL;
+    }
+    recfile->blocks = json_incref(json_object_get(summaries, "blocks"));
+    block_size = json_object_get(summaries, "block_size");
+    recfile->block_size = json_integer_value(block_size) > 0 ? json_integer_value(block_size) : 0;
+    json_decref(summaries);
+    if(!json_is_array(recfile->blocks) || !recfile->block_size)
+        goto invalid;
+
+    return recfile;
+
+invalid:
+    jsonp_error_set(error, -1, -1, 0, "not a UBJSON record file");
+    ubjsonp_unmap_file(&recfile->map);
+    json_decref(recfile->blocks);
+    free(recfile);
+    return NULL;
+}
+
+void ubjson_recfile_close(ubjson_recfile_t *recfile)
+{
+    if(!recfile)
+        return;
+    ubjsonp_unmap_file(&recfile->map);
+    json_decref(recfile->blocks);
+    free(recfile);
+}
+
+size_t ubjson_recfile_count(const ubjson_recfile_t *recfile)
+{
+    return recfile->count;
+}
+
+const void *ubjson_recfile_range(const ubjson_recfile_t *recfile, size_t first, size_t count, size_t *len)
+{
+    uint64_t start, end;
+
+    if(first > recfile->count || count > recfile->count - first)
+        return NULL;
+    start = get_be64(recfile->offsets + first * 8);
+    end = get_be64(recfile->offsets + (first + count) * 8);
+    if(start > end || end > recfile->index_pos)
+        return NULL;
+    if(len)
+        *len = end - start;
+    return (const char *)recfile->map.data + start;
+}
+
+const void *ubjson_recfile_record(const ubjson_recfile_t *recfile, size_t index, size_t *len)
+{
+    return ubjson_recfile_range(recfile, index, 1, len);
+}
+
+json_t *ubjson_recfile_get(const ubjson_recfile_t *recfile, size_t index, size_t flags, json_error_t *error)
+{
+    const void *data;
+    size_t len;
+
+    data = ubjson_recfile_record(recfile, index, &len);
+    if(!data) {
+        jsonp_error_init(error, "<recfile>");
+        jsonp_error_set(error, -1, -1, 0, "record index out of range");
+        return NULL;
+    }
+    return ubjson_loadb((void *)data, len, flags, error);
+}
+
+size_t ubjson_recfile_blocks(const ubjson_recfile_t *recfile)
+{
+    return json_array_size(recfile->blocks);
+}
+
+int ubjson_recfile_block(const ubjson_recfile_t *recfile, size_t block, size_t *first,
+                         const char **min_key, const char **max_key)
+{
+    json_t *summary = json_array_get(recfile->blocks, block);
+    json_t *jfirst = json_object_get(summary, "first");
+    json_t *jmin = json_object_get(summary, "min");
+    json_t *jmax = json_object_get(summary, "max");
+
+    if(!json_is_integer(jfirst) || !json_is_string(jmin) || !json_is_string(jmax))
+        return -1;
+    if(first)
+        *first = json_integer_value(jfirst);
+    if(min_key)
+        *min_key = json_string_value(jmin);
+    if(max_key)
+        *max_key = json_string_value(jmax);
+    return 0;
+}
+
+/*** writer ***/
+
+static int writer_write(const char *buffer, size_t size, void *data)
+{
+    ubjson_recfile_writer_t *writer = data;
+
+    if(writer->failed)
+        return -1;
+    if(size && fwrite(buffer, size, 1, writer->stage ? writer->stage : writer->file) != 1) {
+        writer->failed = 1;
+        return -1;
+    }
+    writer->pos += size;
+    return 0;
+}
+
+/* Drops whatever was written after the last complete record */
+static int writer_rollback(ubjson_recfile_writer_t *writer)
+{
+    FILE *out = writer->stage ? writer->stage : writer->file;
+    uint64_t end = writer->end - writer->base;
+
+    if(!writer->failed && writer->pos == writer->end)
+        return 0;
+#ifdef HAVE_FTRUNCATE
+    clearerr(out);
+    if(!fflush(out) &&
+       !ftruncate(fileno(out), end) &&
+       !fseeko(out, end, SEEK_SET)) {
+        writer->pos = writer->end;
+        writer->failed = 0;
+        return 0;
+    }
+#endif
+    writer->failed = 1;
+    return -1;
+}
+
+static int writer_push_offset(ubjson_recfile_writer_t *writer)
+{
+    if(writer->count == writer->size) {
+        size_t size = writer->size ? writer->size * 2 : 1024;
+        uint64_t *offsets = realloc(writer->offsets, size * sizeof(*offsets));
+
+        if(!offsets)
+            return -1;
+        writer->offsets = offsets;
+        writer->size = size;
+    }
+    writer->offsets[writer->count++] = writer->end;
+    return 0;
+}
+
+/* Records the summary of the block that has just been completed, if any */
+static int writer_end_block(ubjson_recfile_writer_t *writer)
+{
+    size_t first = (writer->count - 1) / writer->block_size * writer->block_size;
+    json_t *summary;
+
+    if(!writer->min_key)
+        return 0;
+
+    summary = json_object();
+    if(!summary ||
+       json_object_set_new(summary, "first", json_integer(first)) ||
+       json_object_set_new(summary, "min", json_string(writer->min_key)) ||
+       json_object_set_new(summary, "max", json_string(writer->max_key)) ||
+       json_array_append_new(writer->blocks, summary))
+        return -1;
+
+    free(writer->min_key);
+    free(writer->max_key);
+    writer->min_key = writer->max_key = NULL;
+    return 0;
+}
+
+static int writer_note_key(ubjson_recfile_writer_t *writer, const char *key)
+{
+    char *copy;
+
+    if(!writer->min_key || strcmp(key, writer->min_key) < 0) {
+        copy = strdup(key);
+        if(!copy)
+            return -1;
+        free(writer->min_key);
+        writer->min_key = copy;
+    }
+    if(!writer->max_key || strcmp(key, writer->max_key) > 0) {
+        copy = strdup(key);
+        if(!copy)
+            return -1;
+        free(writer->max_key);
+        writer->max_key = copy;
+    }
+    return 0;
+}
+
+/* Loads the index of an existing record file so that appends continue it */
+static int writer_resume(ubjson_recfile_writer_t *writer, const char *path, json_error_t *error)
+{
+    ubjson_recfile_t *recfile;
+    json_t *last;
+    size_t i, first;
+    const char *min_key, *max_key;
+
+    recfile = ubjson_recfile_open(path, error);
+    if(!recfile)
+        return -1;
+
+    writer->size = recfile->count + 1024;
+    writer->offsets = malloc(writer->size * sizeof(*writer->offsets));
+    if(!writer->offsets)
+        goto oom;
+    for(i = 0; i < recfile->count; ++i)
+        writer->offsets[i] = get_be64(recfile->offsets + i * 8);
+    writer->count = recfile->count;
+    writer->pos = writer->end = recfile->index_pos;
+    writer->block_size = recfile->block_size;
+
+    if(json_array_extend(writer->blocks, recfile->blocks))
+        goto oom;
+
+    /* reopen a trailing partial block so that it keeps its summary */
+    i = json_array_size(writer->blocks);
+    last = i ? json_array_get(writer->blocks, i - 1) : NULL;
+    if(last && writer->count % writer->block_size &&
+       !ubjson_recfile_block(recfile, i - 1, &first, &min_key, &max_key) &&
+       first == writer->count / writer->block_size * writer->block_size) {
+        if(writer_note_key(writer, min_key) || writer_note_key(writer, max_key))
+            goto oom;
+        json_array_remove(writer->blocks, i - 1);
+    }
+
+    ubjson_recfile_close(recfile);
+    return 0;
+
+oom:
+    jsonp_error_set(error, -1, -1, 0, "out of memory");
+    ubjson_recfile_close(recfile);
+    return -1;
+}
+
+ubjson_recfile_writer_t *ubjson_recfile_writer_open(const char *path, size_t block_size, json_error_t *error)
+{
+    ubjson_recfile_writer_t *writer;
+    FILE *probe;
+
+    jsonp_error_init(error, path);
+
+    if(!path || !block_size) {
+        jsonp_error_set(error, -1, -1, 0, "wrong arguments");
+        return NULL;
+    }
+
+    writer = calloc(1, sizeof(*writer));
+    if(!writer || !(writer->blocks = json_array())) {
+        free(writer);
+        jsonp_error_set(error, -1, -1, 0, "out of memory");
+        return NULL;
+    }
+    writer->block_size = block_size;
+
+    probe = fopen(path, "rb");
+    if(probe && fgetc(probe) != EOF) {
+        fclose(probe);
+#ifdef HAVE_FTRUNCATE
+        if(writer_resume(writer, path, error))
+            goto fail;
+        writer->file = fopen(path, "r+b");
+        if(!writer->file)
+            goto fail_errno;
+        writer->stage = tmpfile();
+        if(!writer->stage)
+            goto fail_errno;
+        writer->base = writer->pos;
+        return writer;
+#else
+        jsonp_error_set(error, -1, -1, 0, "appending to an existing record file is not supported");
+        goto fail;
+#endif
+    }
+    if(probe)
+        fclose(probe);
+
+    writer->file = fopen(path, "wb");
+    if(!writer->file)
+        goto fail_errno;
+    return writer;
+
+fail_errno:
+    jsonp_error_set(error, -1, -1, 0, "unable to open %s: %s", path, strerror(errno));
+fail:
+    if(writer->file)
+        fclose(writer->file);
+    if(writer->stage)
+        fclose(writer->stage);
+    json_decref(writer->blocks);
+    free(writer->offsets);
+    free(writer->min_key);
+    free(writer->max_key);
+    free(writer);
+    return NULL;
+}
+
+/* Moves the staged records over the old index, where the new one follows them */
+static int writer_unstage(ubjson_recfile_writer_t *writer)
+{
+    char buf[4096];
+    size_t n;
+
+    if(fflush(writer->stage) || fseeko(writer->stage, 0, SEEK_SET) ||
+       fseeko(writer->file, writer->base, SEEK_SET))
+        return -1;
+    while((n = fread(buf, 1, sizeof(buf), writer->stage)) > 0)
+        if(fwrite(buf, n, 1, writer->file) != 1)
+            return -1;
+    if(ferror(writer->stage))
+        return -1;
+    fclose(writer->stage);
+    writer->stage = NULL;
+    return 0;
+}
+
+static int writer_begin_record(ubjson_recfile_writer_t *writer)
+{
+    if(writer->failed)
+        return -1;
+    if(writer->count && writer->count % writer->block_size == 0 && writer_end_block(writer))
+        return -1;
+    return 0;
+}
+
+/* Adds the record just written to the index, or rolls it back */
+static int writer_end_record(ubjson_recfile_writer_t *writer, const char *key, int failed)
+{
+    if(!failed && !(key && writer_note_key(writer, key)) && !writer_push_offset(writer)) {
+        writer->end = writer->pos;
+        return 0;
+    }
+    writer_rollback(writer);
+    return -1;
+}
+
+int ubjson_recfile_append(ubjson_recfile_writer_t *writer, json_t *json, const char *key, size_t flags)
+{
+    if(writer_begin_record(writer))
+        return -1;
+    return writer_end_record(writer, key, ubjson_dump_callback(json, writer_write, writer, flags));
+}
+
+int ubjson_recfile_append_raw(ubjson_recfile_writer_t *writer, const void *buffer, size_t buflen, const char *key)
+{
+    if(writer_begin_record(writer))
+        return -1;
+    return writer_end_record(writer, key, writer_write(buffer, buflen, writer));
+}
+
+int ubjson_recfile_writer_close(ubjson_recfile_writer_t *writer)
+{
+    unsigned char buf[RECFILE_TRAILER_SIZE];
+    uint64_t index_pos, summary_pos;
+    json_t *summaries;
+    size_t i;
+    int ret = -1, dumped, summarized;
+
+    if(!writer)
+        return -1;
+
+    /* the index covers every complete record, even after a failed append */
+    if(writer_rollback(writer) || (writer->stage && writer_unstage(writer)))
+        goto out;
+    summarized = !writer->count || !writer_end_block(writer);
+
+    index_pos = writer->pos;
+    for(i = 0; i <= writer->count; ++i) {
+        put_be64(buf, i < writer->count ? writer->offsets[i] : index_pos);
+        if(writer_write((char *)buf, 8, writer))
+            goto out;
+    }
+
+    summary_pos = writer->pos;
+    summaries = json_object();
+    if(!summaries ||
+       json_object_set_new(summaries, "block_size", json_integer(writer->block_size)) ||
+       json_object_set(summaries, "blocks", writer->blocks)) {
+        json_decref(summaries);
+        goto out;
+    }
+    dumped = ubjson_dump_callback(summaries, writer_write, writer, 0);
+    json_decref(summaries);
+    if(dumped)
+        goto out;
+
+    put_be64(buf, writer->count);
+    put_be64(buf + 8, index_pos);
+    put_be64(buf + 16, summary_pos);
+    memcpy(buf + 24, RECFILE_MAGIC, 8);
+    if(writer_write((char *)buf, RECFILE_TRAILER_SIZE, writer))
+        goto out;
+#ifdef HAVE_FTRUNCATE
+    /* after appending, the new index may be shorter than the old one */
+    if(fflush(writer->file) || ftruncate(fileno(writer->file), writer->pos))
+        goto out;
+#endif
+    ret = summarized ? 0 : -1;
+
+out:
+    if(writer->stage)
+        fclose(writer->stage);
+    if(fclose(writer->file))
+        ret = -1;
+    json_decref(writer->blocks);
+    free(writer->offsets);
+    free(writer->min_key);
+    free(writer->max_key);
+    free(writer);
+    return ret;
+}
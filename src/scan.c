@@ -0,0 +1,642 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+/*
+ * Walks encoded UBJSON in memory without building json_t values.  This is
+ * the same grammar parse_ubjson_value() in load.c accepts, but every
+ * value is reported by position so callers can inspect, skip or rewrite
+ * it in place.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+void ubjsonp_scan_init(ubjsonp_scan_t *s, const void *data, size_t len, json_error_t *error)
+{
+    s->data = data;
+    s->len = len;
+    s->pos = 0;
+    s->error = error;
+    s->context = NULL;
+    s->max_hpn_length = 0;
+}
+
+int ubjsonp_scan_error(ubjsonp_scan_t *s, const char *msg)
+{
+    if(s->context)
+        jsonp_error_set(s->error, -1, -1, s->pos, "%s: %s", s->context, msg);
+    else
+        jsonp_error_set(s->error, -1, -1, s->pos, "%s", msg);
+    return -1;
+}
+
+int ubjsonp_scan_byte(ubjsonp_scan_t *s)
+{
+    if(s->pos >= s->len)
+        return EOF;
+    return s->data[s->pos++];
+}
+
+int ubjsonp_scan_marker(ubjsonp_scan_t *s)
+{
+    int c;
+
+    do
+        c = ubjsonp_scan_byte(s);
+    while(c == 'N');
+    return c;
+}
+
+int ubjsonp_type_size(int type)
+{
+    switch(type) {
+        case 'Z': case 'T': case 'F': case 'N':
+            return 0;
+        case 'i': case 'U': case 'C':
+            return 1;
+        case 'I':
+            return 2;
+        case 'l': case 'd':
+            return 4;
+        case 'L': case 'D':
+            return 8;
+        default:
+            return -1;
+    }
+}
+
+int ubjsonp_int_fits(int type, json_int_t value)
+{
+    switch(type) {
+        case 'i': return value >= -128 && value <= 127;
+        case 'U': return value >= 0 && value <= 255;
+        case 'I': return value >= -32768 && value <= 32767;
+        case 'l': return value >= -2147483647L - 1 && value <= 2147483647L;
+        case 'L': return 1;
+        default:  return 0;
+    }
+}
+
+int ubjsonp_int_marker(json_int_t value)
+{
+    static const char markers[] = "iUIl";
+    int i;
+
+    for(i = 0; markers[i]; ++i)
+        if(ubjsonp_int_fits(markers[i], value))
+            return markers[i];
+    return 'L';
+}
+
+void ubjsonp_put_int(unsigned char *p, int type, json_int_t value)
+{
+    int i, sz = ubjsonp_type_size(type);
+
+    for(i = sz - 1; i >= 0; --i) {
+        p[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+json_int_t ubjsonp_get_int(const unsigned char *p, int type)
+{
+    int i, sz = ubjsonp_type_size(type);
+    json_int_t value = (type == 'U') ? 0 : (signed char)p[0];
+
+    if(type == 'U')
+        return p[0];
+    for(i = 1; i < sz; ++i)
+        value = (value * 256) + p[i];
+    return value;
+}
+
+double ubjsonp_get_real(const unsigned char *p, int type)
+{
+    uint64_t bits = 0;
+    int i;
+
+    if(type == 'd') {
+        uint32_t bits32;
+        float f;
+
+        for(i = 0; i < 4; ++i)
+            bits = (bits << 8) | p[i];
+        bits32 = bits;
+        memcpy(&f, &bits32, 4);
+        return f;
+    }
+    else {
+        double f;
+
+        for(i = 0; i < 8; ++i)
+            bits = (bits << 8) | p[i];
+        memcpy(&f, &bits, 8);
+        return f;
+    }
+}
+
+void ubjsonp_put_real(unsigned char *p, int type, double value)
+{
+    uint64_t bits;
+    int i, sz;
+
+    if(type == 'd') {
+        float f = value;
+        uint32_t bits32;
+
+        memcpy(&bits32, &f, 4);
+        bits = bits32;
+        sz = 4;
+    }
+    else {
+        memcpy(&bits, &value, 8);
+        sz = 8;
+    }
+    for(i = sz - 1; i >= 0; --i) {
+        p[i] = bits & 0xff;
+        bits >>= 8;
+    }
+}
+
+static int host_is_big_endian(void)
+{
+    const uint16_t probe = 1;
+    return *(const unsigned char *)&probe == 0;
+}
+
+/*
+ * One loop per width over whole words, so compilers turn the shifts into
+ * byte swap instructions and vectorize the loop.
+ */
+void ubjsonp_copy_be(void *dst, const void *src, int width, size_t count)
+{
+    unsigned char *d = dst;
+    const unsigned char *p = src;
+    size_t i;
+
+    if(width == 1 || host_is_big_endian()) {
+        memmove(dst, src, width * count);
+        return;
+    }
+    switch(width) {
+        case 2:
+            for(i = 0; i < count; ++i) {
+                uint16_t x;
+                memcpy(&x, p + i * 2, 2);
+                x = (uint16_t)((x >> 8) | (x << 8));
+                memcpy(d + i * 2, &x, 2);
+            }
+            break;
+        case 4:
+            for(i = 0; i < count; ++i) {
+                uint32_t x;
+                memcpy(&x, p + i * 4, 4);
+                x = ((x & 0xff00ff00U) >> 8) | ((x & 0x00ff00ffU) << 8);
+                x = (x >> 16) | (x << 16);
+                memcpy(d + i * 4, &x, 4);
+            }
+            break;
+        case 8:
+            for(i = 0; i < count; ++i) {
+                uint64_t x;
+                memcpy(&x, p + i * 8, 8);
+                x = ((x & UINT64_C(0xff00ff00ff00ff00)) >> 8) | ((x & UINT64_C(0x00ff00ff00ff00ff)) << 8);
+                x = ((x & UINT64_C(0xffff0000ffff0000)) >> 16) | ((x & UINT64_C(0x0000ffff0000ffff)) << 16);
+                x = (x >> 32) | (x << 32);
+                memcpy(d + i * 8, &x, 8);
+            }
+            break;
+    }
+}
+
+int ubjsonp_scan_int(ubjsonp_scan_t *s, int type, json_int_t *out)
+{
+    int sz = ubjsonp_type_size(type);
+
+    if(sz <= 0 || type == 'C' || type == 'd' || type == 'D')
+        return ubjsonp_scan_error(s, "integer expected");
+    if(s->len - s->pos < (size_t)sz)
+        return ubjsonp_scan_error(s, "premature end of input");
+    *out = ubjsonp_get_int(s->data + s->pos, type);
+    s->pos += sz;
+    return 0;
+}
+
+static int scan_string(ubjsonp_scan_t *s, const char **str, size_t *len, int depth);
+
+/* Sizes may themselves be high-precision numbers, as load.c allows */
+static int scan_size(ubjsonp_scan_t *s, json_int_t *out, int depth)
+{
+    int type = ubjsonp_scan_marker(s);
+
+    if(type == EOF)
+        return ubjsonp_scan_error(s, "premature end of input");
+    if(type == 'H') {
+        const char *str = NULL;
+        size_t len = 0;
+
+        if(depth >= UBJSONP_MAX_DEPTH)
+            return ubjsonp_scan_error(s, "maximum nesting depth exceeded");
+        if(scan_string(s, &str, &len, depth + 1))
+            return -1;
+        if(s->max_hpn_length && len > s->max_hpn_length)
+            return ubjsonp_scan_error(s, "string too long");
+        if(ubjsonp_check_hpn(str, len, out))
+            return ubjsonp_scan_error(s, "non-integer size");
+        if(*out < 0)
+            return ubjsonp_scan_error(s, "negative size");
+        return 0;
+    }
+    if(ubjsonp_scan_int(s, type, out))
+        return -1;
+    if(*out < 0)
+        return ubjsonp_scan_error(s, "negative size");
+    return 0;
+}
+
+static int scan_string(ubjsonp_scan_t *s, const char **str, size_t *len, int depth)
+{
+    json_int_t size;
+
+    if(scan_size(s, &size, depth))
+        return -1;
+    if((unsigned long long)size > s->len - s->pos)
+        return ubjsonp_scan_error(s, "premature end of input");
+    *str = (const char *)s->data + s->pos;
+    *len = size;
+    s->pos += size;
+    return 0;
+}
+
+int ubjsonp_scan_size(ubjsonp_scan_t *s, json_int_t *out)
+{
+    return scan_size(s, out, 0);
+}
+
+int ubjsonp_scan_string(ubjsonp_scan_t *s, const char **str, size_t *len)
+{
+    return scan_string(s, str, len, 0);
+}
+
+/* A high-precision number is one ubjsonp_check_hpn() accepts; json_loadb()
+   converts reals so they come out as jansson would parse them */
+json_t *ubjsonp_load_hpn(const char *str, size_t len)
+{
+    json_int_t value;
+    int r = ubjsonp_check_hpn(str, len, &value);
+
+    if(r < 0)
+        return NULL;
+    if(r == 0)
+        return json_integer(value);
+    return json_loadb(str, len, JSON_DECODE_ANY, NULL);
+}
+
+/*
+ * Rejects counts the input cannot possibly hold before any element is
+ * parsed; avail is the input left, or (size_t)-1 for a stream.  Elements
+ * of zero-width types take no input at all, so max_count or
+ * UBJSONP_MAX_ZERO_WIDTH_COUNT bounds those.  No-op elements count as
+ * values.  Returns the error message, or NULL.
+ */
+const char *ubjsonp_check_count(const ubjson_limits_t *limits, int type, int contained_type,
+                                json_int_t count, size_t nodes, size_t avail)
+{
+    size_t max_count = limits ? limits->max_count : 0, max_nodes = limits ? limits->max_nodes : 0;
+    int min_size = 1;
+
+    if(max_count && (unsigned long long)count > max_count)
+        return "too many items";
+    if(contained_type && (min_size = ubjsonp_type_size(contained_type)) < 0)
+        min_size = 1;
+    if(type == '{')
+        min_size += 2;  /* shortest key: length marker and length */
+    if(!max_count && !min_size && count > UBJSONP_MAX_ZERO_WIDTH_COUNT)
+        return "too many items";
+    if(max_nodes && (unsigned long long)count > max_nodes - nodes)
+        return "too many values";
+    if(min_size && (unsigned long long)count > avail / min_size)
+        return "premature end of input";
+    return NULL;
+}
+
+/* JSON number syntax, which json_loads() requires of high-precision numbers */
+int ubjsonp_is_number(const char *p, size_t len)
+{
+    const char *end = p + len;
+
+#define digit(p)  ((p) < end && *(p) >= '0' && *(p) <= '9')
+    if(p < end && *p == '-')
+        ++p;
+    if(p < end && *p == '0')
+        ++p;
+    else if(digit(p))
+        while(digit(p))
+            ++p;
+    else
+        return 0;
+    if(p < end && *p == '.') {
+        ++p;
+        if(!digit(p))
+            return 0;
+        while(digit(p))
+            ++p;
+    }
+    if(p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        if(p < end && (*p == '+' || *p == '-'))
+            ++p;
+        if(!digit(p))
+            return 0;
+        while(digit(p))
+            ++p;
+    }
+#undef digit
+    return p == end;
+}
+
+/*
+ * Significant digits kept when checking a real: the smallest number that
+ * overflows a double, 2^1024 - 2^970, has 309 of them, so the first 310
+ * and whether any later digit is nonzero decide whether strtod() does.
+ */
+#define HPN_REAL_DIGITS  310
+
+/*
+ * Classifies a high-precision number without allocating: it must be a
+ * JSON number, perhaps with whitespace around it, that json_loadb()
+ * can convert, so integers must fit a json_int_t and reals must not
+ * overflow.  Returns 0 for an integer, stored in *ival unless it is
+ * NULL, 1 for a real and -1 for anything else.
+ */
+int ubjsonp_check_hpn(const char *str, size_t len, json_int_t *ival)
+{
+    char buf[HPN_REAL_DIGITS + 16], *end;
+    size_t i = 0, n = 0, ndigits = 0;
+    long exponent = 0, e = 0;
+    int point = 0, sticky = 0, sign = 1;
+    json_int_t value;
+
+    /* json_loadb() skips whitespace around the number */
+#define space(c)  ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+    while(len && space(str[0]))
+        ++str, --len;
+    while(len && space(str[len - 1]))
+        --len;
+#undef space
+    if(!ubjsonp_is_number(str, len))
+        return -1;
+
+    if(!memchr(str, '.', len) && !memchr(str, 'e', len) && !memchr(str, 'E', len)) {
+        /* a sign and 19 digits is as long as a json_int_t gets */
+        if(len > 20)
+            return -1;
+        memcpy(buf, str, len);
+        buf[len] = '\0';
+        errno = 0;
+        value = strtoll(buf, &end, 10);
+        if(errno == ERANGE)
+            return -1;
+        if(ival)
+            *ival = value;
+        return 0;
+    }
+
+    /* rewrite the mantissa as an integer, with no locale-dependent point */
+    if(str[i] == '-')
+        buf[n++] = str[i++];
+    for(; i < len && str[i] != 'e' && str[i] != 'E'; ++i) {
+        if(str[i] == '.') {
+            point = 1;
+            continue;
+        }
+        if(point)
+            --exponent;
+        if(!ndigits && str[i] == '0')
+            continue;
+        if(ndigits < HPN_REAL_DIGITS) {
+            buf[n++] = str[i];
+            ++ndigits;
+        }
+        else {
+            ++exponent;
+            sticky |= (str[i] != '0');
+        }
+    }
+    if(!ndigits)
+        return 1;
+    if(sticky) {
+        buf[n++] = '1';
+        --exponent;
+    }
+
+    if(i < len) {
+        if(str[++i] == '+' || str[i] == '-')
+            sign = (str[i++] == '-') ? -1 : 1;
+        for(; i < len; ++i)
+            if(e < 1000000)
+                e = e * 10 + (str[i] - '0');
+        exponent += sign * e;
+    }
+    /* far enough out either way to overflow or underflow anything */
+    if(exponent > 99999)
+        exponent = 99999;
+    else if(exponent < -99999)
+        exponent = -99999;
+    snprintf(buf + n, sizeof(buf) - n, "e%ld", exponent);
+
+    return isinf(strtod(buf, NULL)) ? -1 : 1;
+}
+
+size_t ubjsonp_utf8_valid(const unsigned char *str, size_t len)
+{
+    size_t i = 0;
+
+    while(i < len) {
+        unsigned int c = str[i], lo = 0x80, hi = 0xBF;
+        size_t n, j;
+
+        if(c < 0x80) {
+            /* runs of ASCII are checked a word at a time */
+            while(len - i >= 8) {
+                uint64_t w;
+                memcpy(&w, str + i, 8);
+                if(w & UINT64_C(0x8080808080808080))
+                    break;
+                i += 8;
+            }
+            while(i < len && str[i] < 0x80)
+                ++i;
+            continue;
+        }
+
+        if(c >= 0xC2 && c <= 0xDF)
+            n = 1;
+        else if(c >= 0xE0 && c <= 0xEF)
+            n = 2;
+        else if(c >= 0xF0 && c <= 0xF4)
+            n = 3;
+        else
+            return i;
+        if(len - i <= n)
+            return i;
+
+        /* reject overlong forms, surrogates and code points past U+10FFFF */
+        if(c == 0xE0)
+            lo = 0xA0;
+        else if(c == 0xED)
+            hi = 0x9F;
+        else if(c == 0xF0)
+            lo = 0x90;
+        else if(c == 0xF4)
+            hi = 0x8F;
+        if(str[i + 1] < lo || str[i + 1] > hi)
+            return i;
+        for(j = 2; j <= n; ++j)
+            if((str[i + j] & 0xC0) != 0x80)
+                return i;
+        i += n + 1;
+    }
+    return len;
+}
+
+/*
+ * Reads the optional '$' type and '#' count of a container whose marker
+ * has been read, and checks the count with ubjsonp_check_count() the way
+ * load.c does; nodes is the number of values already seen.  Arrays of
+ * fixed-size elements are left for the caller to bound against the input.
+ */
+int ubjsonp_scan_open(ubjsonp_scan_t *s, int type, ubjsonp_container_t *c,
+                      const ubjson_limits_t *limits, size_t nodes)
+{
+    const char *msg;
+    int fixed;
+
+    c->type = type;
+    c->contained_type = 0;
+    c->count = -1;
+
+    if(s->pos < s->len && s->data[s->pos] == '$') {
+        /* sole contained type */
+        s->pos++;
+        c->contained_type = ubjsonp_scan_byte(s);
+        if(c->contained_type == EOF)
+            return ubjsonp_scan_error(s, "premature end of input");
+        if(s->pos >= s->len || s->data[s->pos] != '#')
+            return ubjsonp_scan_error(s, "container has type without count");
+    }
+    if(s->pos < s->len && s->data[s->pos] == '#') {
+        /* fixed item count */
+        s->pos++;
+        if(ubjsonp_scan_size(s, &c->count))
+            return -1;
+        fixed = (type == '[' && ubjsonp_type_size(c->contained_type) >= 0);
+        msg = ubjsonp_check_count(limits, type, c->contained_type, c->count, nodes,
+                                  fixed ? (size_t)-1 : s->len - s->pos);
+        if(msg)
+            return ubjsonp_scan_error(s, msg);
+    }
+    return 0;
+}
+
+int ubjsonp_scan_next(ubjsonp_scan_t *s, ubjsonp_container_t *c,
+                      const char **key, size_t *keylen, int *type)
+{
+    int ch;
+
+    if(c->type == '[' && c->contained_type == 'N') {
+        /* nothing but no-op elements, which take no input */
+        c->count = 0;
+        return 0;
+    }
+    for(;;) {
+        if(c->count == 0)
+            return 0;
+        if(c->count < 0) {
+            if(s->pos >= s->len)
+                return ubjsonp_scan_error(s, "premature end of input");
+            ch = s->data[s->pos];
+            if(ch == (c->type == '[' ? ']' : '}')) {
+                s->pos++;
+                c->count = 0;
+                return 0;
+            }
+        }
+        else
+            c->count--;
+
+        if(c->type == '{' && ubjsonp_scan_string(s, key, keylen))
+            return -1;
+        if(c->contained_type)
+            *type = c->contained_type;
+        else
+            *type = ubjsonp_scan_byte(s);
+        if(*type == EOF)
+            return ubjsonp_scan_error(s, "premature end of input");
+        if(*type != 'N')
+            return 1;
+    }
+}
+
+static int scan_skip(ubjsonp_scan_t *s, int type, int depth)
+{
+    int sz = ubjsonp_type_size(type);
+
+    if(sz >= 0) {
+        if(s->len - s->pos < (size_t)sz)
+            return ubjsonp_scan_error(s, "premature end of input");
+        s->pos += sz;
+        return 0;
+    }
+    switch(type) {
+        case 'S': case 'H': {
+            const char *str;
+            size_t len;
+            return ubjsonp_scan_string(s, &str, &len);
+        }
+        case '[': case '{': {
+            ubjsonp_container_t c;
+            const char *key;
+            size_t keylen;
+            int r, elem_type;
+
+            if(depth >= UBJSONP_MAX_DEPTH)
+                return ubjsonp_scan_error(s, "maximum nesting depth exceeded");
+            if(ubjsonp_scan_open(s, type, &c, NULL, 0))
+                return -1;
+            if(type == '[' && c.count > 0 && (sz = ubjsonp_type_size(c.contained_type)) >= 0) {
+                /* fixed-size elements: skip them all at once */
+                if(sz && (unsigned long long)c.count > (s->len - s->pos) / sz)
+                    return ubjsonp_scan_error(s, "premature end of input");
+                s->pos += c.count * sz;
+                return 0;
+            }
+            while((r = ubjsonp_scan_next(s, &c, &key, &keylen, &elem_type)) == 1)
+                if(scan_skip(s, elem_type, depth + 1))
+                    return -1;
+            return r;
+        }
+        case EOF:
+            return ubjsonp_scan_error(s, "premature end of input");
+        default:
+            return ubjsonp_scan_error(s, "unrecognized type");
+    }
+}
+
+int ubjsonp_scan_skip(ubjsonp_scan_t *s, int type)
+{
+    return scan_skip(s, type, 0);
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+static int is_numeric(int type)
+{
+    switch(type) {
+        case 'i': case 'U': case 'I': case 'l': case 'L': case 'd': case 'D':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void put_native_int(void *dst, int type, json_int_t v)
+{
+    switch(type) {
+        case 'i': { int8_t x = v;   memcpy(dst, &x, 1); break; }
+        case 'U': { uint8_t x = v;  memcpy(dst, &x, 1); break; }
+        case 'I': { int16_t x = v;  memcpy(dst, &x, 2); break; }
+        case 'l': { int32_t x = v;  memcpy(dst, &x, 4); break; }
+        case 'L': { int64_t x = v;  memcpy(dst, &x, 8); break; }
+        case 'd': { float x = v;    memcpy(dst, &x, 4); break; }
+        case 'D': { double x = v;   memcpy(dst, &x, 8); break; }
+    }
+}
+
+json_int_t ubjsonp_get_native_int(const void *src, int type)
+{
+    switch(type) {
+        case 'i': { int8_t x;   memcpy(&x, src, 1); return x; }
+        case 'U': { uint8_t x;  memcpy(&x, src, 1); return x; }
+        case 'I': { int16_t x;  memcpy(&x, src, 2); return x; }
+        case 'l': { int32_t x;  memcpy(&x, src, 4); return x; }
+        default:  { int64_t x;  memcpy(&x, src, 8); return x; }
+    }
+}
+
+/* Decodes a number encoded as type into a C value of type ctype */
+int ubjsonp_scan_number(ubjsonp_scan_t *s, int ctype, int type, void *dst)
+{
+    int sz = ubjsonp_type_size(type);
+    json_int_t v;
+    double f;
+
+    switch(type) {
+        case 'i': case 'U': case 'I': case 'l': case 'L':
+            if(ubjsonp_scan_int(s, type, &v))
+                return -1;
+            if(ctype != 'd' && ctype != 'D' && !ubjsonp_int_fits(ctype, v))
+                return ubjsonp_scan_error(s, "integer out of range");
+            put_native_int(dst, ctype, v);
+            return 0;
+        case 'd': case 'D':
+            if(ctype != 'd' && ctype != 'D')
+                return ubjsonp_scan_error(s, "integer expected");
+            if(s->len - s->pos < (size_t)sz)
+                return ubjsonp_scan_error(s, "premature end of input");
+            f = ubjsonp_get_real(s->data + s->pos, type);
+            s->pos += sz;
+            break;
+        case 'H': {
+            const char *str;
+            size_t len;
+            char buf[64], *end;
+
+            if(ubjsonp_scan_string(s, &str, &len))
+                return -1;
+            /* strtod() and strtoll() take more than JSON numbers */
+            if(!ubjsonp_is_number(str, len))
+                return ubjsonp_scan_error(s, "failed parsing high-precision number");
+            if(len >= sizeof(buf))
+                return ubjsonp_scan_error(s, "unsupported high-precision number");
+            memcpy(buf, str, len);
+            buf[len] = '\0';
+            errno = 0;
+            if(ctype == 'd' || ctype == 'D') {
+                f = strtod(buf, &end);
+                if(*end || (errno == ERANGE && isinf(f)))
+                    return ubjsonp_scan_error(s, "failed parsing high-precision number");
+                break;
+            }
+            /* out of range values clamp to LLONG_MIN or LLONG_MAX */
+            v = strtoll(buf, &end, 10);
+            if(*end || errno == ERANGE || !ubjsonp_int_fits(ctype, v))
+                return ubjsonp_scan_error(s, "integer out of range");
+            put_native_int(dst, ctype, v);
+            return 0;
+        }
+        default:
+            return ubjsonp_scan_error(s, "number expected");
+    }
+
+    if(ctype == 'd') {
+        float x = f;
+        memcpy(dst, &x, 4);
+    }
+    else
+        memcpy(dst, &f, 8);
+    return 0;
+}
+
+/* Decodes an array whose '[' marker has been read into up to capacity
+   C values of type ctype */
+int ubjsonp_scan_typed_array(ubjsonp_scan_t *s, int ctype, void *dst, size_t capacity, size_t *count)
+{
+    ubjsonp_container_t c;
+    const char *key;
+    size_t keylen, n = 0;
+    int esize = ubjsonp_type_size(ctype);
+    int r, elem_type;
+
+    if(!is_numeric(ctype))
+        return ubjsonp_scan_error(s, "unsupported element type");
+    if(ubjsonp_scan_open(s, '[', &c, NULL, 0))
+        return -1;
+
+    if(c.contained_type == ctype) {
+        /* same element type on the wire: convert the whole payload at once */
+        if((unsigned long long)c.count > capacity)
+            return ubjsonp_scan_error(s, "array too long");
+        if((unsigned long long)c.count > (s->len - s->pos) / esize)
+            return ubjsonp_scan_error(s, "premature end of input");
+        ubjsonp_copy_be(dst, s->data + s->pos, esize, c.count);
+        s->pos += c.count * esize;
+        n = c.count;
+    }
+    else {
+        while((r = ubjsonp_scan_next(s, &c, &key, &keylen, &elem_type)) == 1) {
+            if(n == capacity)
+                return ubjsonp_scan_error(s, "array too long");
+            if(ubjsonp_scan_number(s, ctype, elem_type, (char *)dst + n * esize))
+                return -1;
+            ++n;
+        }
+        if(r < 0)
+            return -1;
+    }
+
+    *count = n;
+    return 0;
+}
+
+int ubjson_dump_typed_array(int type, const void *values, size_t count,
+                            json_dump_callback_t callback, void *data)
+{
+    unsigned char buf[4096];
+    const char *src = values;
+    size_t done, chunk;
+    int esize = ubjsonp_type_size(type);
+
+    if(!is_numeric(type) || (count && !values))
+        return -1;
+
+    buf[0] = '[';
+    buf[1] = '$';
+    buf[2] = type;
+    buf[3] = '#';
+    if(callback((char *)buf, 4, data) || ubjsonp_dump_int(count, callback, data))
+        return -1;
+    for(done = 0; done < count; done += chunk) {
+        chunk = count - done;
+        if(chunk > sizeof(buf) / esize)
+            chunk = sizeof(buf) / esize;
+        ubjsonp_copy_be(buf, src + done * esize, esize, chunk);
+        if(callback((char *)buf, chunk * esize, data))
+            return -1;
+    }
+    return 0;
+}
+
+ssize_t ubjson_dumpb_typed_array(int type, const void *values, size_t count,
+                                 void *buffer, size_t buflen)
+{
+    struct ubjsonp_dumpb_data data;
+
+    data.p = buffer;
+    data.rem = buflen;
+    data.sz = 0;
+
+    if(ubjson_dump_typed_array(type, values, count, ubjsonp_dumpb_callback, &data))
+        return -1;
+
+    return data.sz;
+}
+
+ssize_t ubjson_load_typed_array(const void *buffer, size_t buflen, int type, void *values,
+                                size_t capacity, size_t *count, json_error_t *error)
+{
+    ubjsonp_scan_t s;
+
+    jsonp_error_init(error, "<buffer>");
+
+    if(!buffer || !count || (capacity && !values)) {
+        jsonp_error_set(error, -1, -1, 0, "wrong arguments");
+        return -1;
+    }
+
+    ubjsonp_scan_init(&s, buffer, buflen, error);
+    if(ubjsonp_scan_marker(&s) != '[')
+        return ubjsonp_scan_error(&s, "'[' expected");
+    if(ubjsonp_scan_typed_array(&s, type, values, capacity, count))
+        return -1;
+    return s.pos;
+}
@@ -9,9 +9,11 @@
 #ifndef UBJANSSON_H
 #define UBJANSSON_H
 
+#include <stddef.h>  /* for offsetof */
 #include <stdio.h>
 #include <stdlib.h>  /* for size_t */
 #include <stdarg.h>
+#include <stdint.h>
 
 #include <jansson.h>
 
@@ -35,17 +37,215 @@ extern "C" {
                                 (UBJANSSON_MICRO_VERSION << 0))
 
 
+/* validation without decoding; 0 means no limit, except that counts of
+   zero-width elements such as [$Z#... are capped at 2^20 */
+
+typedef struct ubjson_limits {
+    size_t max_depth;
+    size_t max_count;
+    size_t max_string_length;
+    size_t max_nodes;
+} ubjson_limits_t;
+
+/* Returns the length of the document, or -1 on error */
+ssize_t ubjson_validate(const void *buffer, size_t buflen, size_t flags, const ubjson_limits_t *limits, json_error_t *error);
+
+
 /* decoding */
 
 json_t *ubjson_loadb(void *buffer, size_t buflen, size_t flags, json_error_t *error);
 json_t *ubjson_loadf(FILE *input, size_t flags, json_error_t *error);
 
+/* Shares one json_t between equal short string values.  Interned strings
+   must not be modified with json_string_set(). */
+typedef struct ubjson_intern ubjson_intern_t;
+
+ubjson_intern_t *ubjson_intern_new(size_t max_entries, size_t max_length);
+void ubjson_intern_free(ubjson_intern_t *intern);
+void ubjson_intern_stats(const ubjson_intern_t *intern, size_t *hits, size_t *misses, size_t *entries);
+
+typedef struct {
+    const ubjson_limits_t *limits;  /* for untrusted input; NULL for none */
+    ubjson_intern_t *intern;        /* NULL to not intern strings */
+} ubjson_load_opts_t;
+
+json_t *ubjson_loadb_opts(void *buffer, size_t buflen, size_t flags, const ubjson_load_opts_t *opts, json_error_t *error);
+json_t *ubjson_loadf_opts(FILE *input, size_t flags, const ubjson_load_opts_t *opts, json_error_t *error);
+
+
+/* files, read through a memory mapping where the platform has one */
+
+json_t *ubjson_load_file(const char *path, size_t flags, json_error_t *error);
+json_t *ubjson_load_file_opts(const char *path, size_t flags, const ubjson_load_opts_t *opts, json_error_t *error);
+
+/* Keeps a file mapped so values decoded from it without copying, such as
+   ubjson_string_ref_t fields, stay valid until ubjson_mapping_close() */
+typedef struct ubjson_mapping ubjson_mapping_t;
+
+ubjson_mapping_t *ubjson_mapping_open(const char *path, json_error_t *error);
+const void *ubjson_mapping_data(const ubjson_mapping_t *mapping, size_t *len);
+void ubjson_mapping_close(ubjson_mapping_t *mapping);
+
 
 /* encoding */
 
 ssize_t ubjson_dumpb(json_t *json, void *buffer, size_t buflen, size_t flags);
 int ubjson_dump_callback(json_t *json, json_dump_callback_t callback, void *data, size_t flags);
 
+/* Reuses the encoding of arrays and objects from earlier dumps.  After
+   changing a container or any value inside it in place, pass the
+   container to ubjson_cache_invalidate(); this also drops the encoding
+   of every cached container that includes it, while the containers it
+   includes stay cached.  The next dump of a container releases the
+   cached children it no longer includes.  Every cached container keeps
+   its own copy of its encoding, so nested containers are stored once per
+   cached level above them: memory grows with the encoded size times the
+   nesting depth. */
+typedef struct ubjson_cache ubjson_cache_t;
+
+ubjson_cache_t *ubjson_cache_new(void);
+void ubjson_cache_free(ubjson_cache_t *cache);
+void ubjson_cache_invalidate(ubjson_cache_t *cache, json_t *json);
+void ubjson_cache_clear(ubjson_cache_t *cache);
+size_t ubjson_cache_size(const ubjson_cache_t *cache);
+
+/* Digests of the encoded bytes, computed as they are written.  Dump with
+   JSON_SORT_KEYS so that equal values always encode, and hash, alike. */
+#define UBJSON_DIGEST_SHA256  0x1
+
+typedef struct ubjson_digest {
+    int flags;                  /* UBJSON_DIGEST_* to compute besides xxh64 */
+    uint64_t xxh64;             /* XXH64, seed 0 */
+    unsigned char sha256[32];
+} ubjson_digest_t;
+
+void ubjson_digest_buffer(const void *buffer, size_t buflen, ubjson_digest_t *digest);
+
+typedef struct {
+    ubjson_cache_t *cache;      /* NULL to encode everything */
+    ubjson_digest_t *digest;    /* filled in when the dump succeeds */
+} ubjson_dump_opts_t;
+
+ssize_t ubjson_dumpb_opts(json_t *json, void *buffer, size_t buflen, size_t flags, const ubjson_dump_opts_t *opts);
+int ubjson_dump_callback_opts(json_t *json, json_dump_callback_t callback, void *data, size_t flags, const ubjson_dump_opts_t *opts);
+
+
+/* streaming writer: encodes values as they are produced, without json_t.
+   type is a '$' element type or 0, count the element count or -1.  Any
+   misuse, such as a value where a key is expected or a second top-level
+   value, fails the writer.
+   Outside typed containers, scalars are written byte for byte as
+   ubjson_dump_callback() writes them. */
+
+typedef struct ubjson_writer ubjson_writer_t;
+
+ubjson_writer_t *ubjson_writer_new(json_dump_callback_t callback, void *data);
+ubjson_writer_t *ubjson_writer_new_buffer(void *buffer, size_t buflen);
+size_t ubjson_writer_size(const ubjson_writer_t *writer);
+/* Returns -1 if the writer failed or containers are left open */
+int ubjson_writer_close(ubjson_writer_t *writer);
+
+int ubjson_writer_begin_array(ubjson_writer_t *writer, int type, ssize_t count);
+int ubjson_writer_end_array(ubjson_writer_t *writer);
+int ubjson_writer_begin_object(ubjson_writer_t *writer, int type, ssize_t count);
+int ubjson_writer_end_object(ubjson_writer_t *writer);
+int ubjson_writer_key(ubjson_writer_t *writer, const char *key, size_t len);
+int ubjson_writer_null(ubjson_writer_t *writer);
+int ubjson_writer_bool(ubjson_writer_t *writer, int value);
+int ubjson_writer_int(ubjson_writer_t *writer, json_int_t value);
+int ubjson_writer_real(ubjson_writer_t *writer, double value);
+int ubjson_writer_string(ubjson_writer_t *writer, const char *value, size_t len);
+int ubjson_writer_json(ubjson_writer_t *writer, json_t *json, size_t flags);
+int ubjson_writer_typed_array(ubjson_writer_t *writer, int type, const void *values, size_t count);
+
+
+/* transcoding between JSON text and UBJSON without building a json_t tree */
+
+int ubjson_convert_from_json(json_load_callback_t input, void *input_data, json_dump_callback_t output, void *output_data, size_t flags, json_error_t *error);
+int ubjson_convert_to_json(json_load_callback_t input, void *input_data, json_dump_callback_t output, void *output_data, size_t flags, json_error_t *error);
+int ubjson_convertf_from_json(FILE *input, FILE *output, size_t flags, json_error_t *error);
+int ubjson_convertf_to_json(FILE *input, FILE *output, size_t flags, json_error_t *error);
+
+
+/* seekable record files: concatenated UBJSON records plus a trailing index */
+
+typedef struct ubjson_recfile ubjson_recfile_t;
+typedef struct ubjson_recfile_writer ubjson_recfile_writer_t;
+
+/* Opening an existing file appends to it with the file's own block size;
+   the file is only rewritten, from its old index on, when the writer is
+   closed.  A failed append is rolled back, so the records before it stay
+   indexed. */
+ubjson_recfile_writer_t *ubjson_recfile_writer_open(const char *path, size_t block_size, json_error_t *error);
+int ubjson_recfile_append(ubjson_recfile_writer_t *writer, json_t *json, const char *key, size_t flags);
+int ubjson_recfile_append_raw(ubjson_recfile_writer_t *writer, const void *buffer, size_t buflen, const char *key);
+int ubjson_recfile_writer_close(ubjson_recfile_writer_t *writer);
+
+ubjson_recfile_t *ubjson_recfile_open(const char *path, json_error_t *error);
+void ubjson_recfile_close(ubjson_recfile_t *recfile);
+size_t ubjson_recfile_count(const ubjson_recfile_t *recfile);
+const void *ubjson_recfile_record(const ubjson_recfile_t *recfile, size_t index, size_t *len);
+const void *ubjson_recfile_range(const ubjson_recfile_t *recfile, size_t first, size_t count, size_t *len);
+json_t *ubjson_recfile_get(const ubjson_recfile_t *recfile, size_t index, size_t flags, json_error_t *error);
+size_t ubjson_recfile_blocks(const ubjson_recfile_t *recfile);
+int ubjson_recfile_block(const ubjson_recfile_t *recfile, size_t block, size_t *first, const char **min_key, const char **max_key);
+
+
+/* in-place editing of encoded documents */
+
+/* path is a JSON Pointer ("/a/0/b"); buffer has room for bufsize bytes.
+   Returns the new length of the document, or -1 on error. */
+ssize_t ubjson_patch(void *buffer, size_t buflen, size_t bufsize, const char *path, json_t *value, json_error_t *error);
+
+
+/* binding C structs: types are named after their UBJSON markers */
+
+#define UBJSON_TYPE_INT8     'i'  /* int8_t */
+#define UBJSON_TYPE_UINT8    'U'  /* uint8_t */
+#define UBJSON_TYPE_INT16    'I'  /* int16_t */
+#define UBJSON_TYPE_INT32    'l'  /* int32_t */
+#define UBJSON_TYPE_INT64    'L'  /* int64_t */
+#define UBJSON_TYPE_FLOAT32  'd'  /* float */
+#define UBJSON_TYPE_FLOAT64  'D'  /* double */
+#define UBJSON_TYPE_BOOL     'T'  /* int or a one byte bool */
+#define UBJSON_TYPE_STRING   'S'  /* char[size], NUL terminated */
+#define UBJSON_TYPE_ARRAY    '['  /* numeric elem_type[size / element size] */
+#define UBJSON_TYPE_STRING_REF  'r'  /* ubjson_string_ref_t into the input buffer */
+
+/* Valid only as long as the decoded buffer; not NUL terminated */
+typedef struct {
+    const char *str;
+    size_t len;
+} ubjson_string_ref_t;
+
+typedef struct {
+    const char *key;
+    int type;
+    size_t offset;
+    size_t size;
+    int elem_type;        /* UBJSON_TYPE_ARRAY only */
+    size_t count_offset;  /* UBJSON_TYPE_ARRAY only: size_t element count */
+} ubjson_field_t;
+
+#define UBJSON_FIELD(st, member, type) \
+    { #member, (type), offsetof(st, member), sizeof(((st *)0)->member), 0, 0 }
+#define UBJSON_FIELD_ARRAY(st, member, elem_type, count_member) \
+    { #member, UBJSON_TYPE_ARRAY, offsetof(st, member), sizeof(((st *)0)->member), \
+      (elem_type), offsetof(st, count_member) }
+
+int ubjson_loadb_struct(const void *buffer, size_t buflen, const ubjson_field_t *fields, size_t nfields, void *out, size_t flags, json_error_t *error);
+int ubjson_dump_struct_callback(const void *in, const ubjson_field_t *fields, size_t nfields, json_dump_callback_t callback, void *data);
+ssize_t ubjson_dumpb_struct(const void *in, const ubjson_field_t *fields, size_t nfields, void *buffer, size_t buflen);
+
+
+/* native C arrays of UBJSON_TYPE_* numbers, encoded as one [$type#count container */
+
+int ubjson_dump_typed_array(int type, const void *values, size_t count, json_dump_callback_t callback, void *data);
+ssize_t ubjson_dumpb_typed_array(int type, const void *values, size_t count, void *buffer, size_t buflen);
+/* Accepts any array of numbers that fit type.  Returns the number of bytes
+   consumed, so the array may be embedded in a larger document. */
+ssize_t ubjson_load_typed_array(const void *buffer, size_t buflen, int type, void *values, size_t capacity, size_t *count, json_error_t *error);
+
 
 #ifdef __cplusplus
 }
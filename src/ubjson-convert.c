@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ubjansson.h"
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [-u | -j] [-a] [INPUT [OUTPUT]]\n"
+            "  -u  convert JSON text to UBJSON (default)\n"
+            "  -j  convert UBJSON to JSON text\n"
+            "  -a  accept any value at the top level, not just arrays and objects\n",
+            argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    int to_json = 0;
+    size_t flags = 0;
+    FILE *input = stdin, *output = stdout;
+    json_error_t error;
+    int i, ret;
+
+    for(i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; ++i) {
+        if(!strcmp(argv[i], "-u"))
+            to_json = 0;
+        else if(!strcmp(argv[i], "-j"))
+            to_json = 1;
+        else if(!strcmp(argv[i], "-a"))
+            flags |= JSON_DECODE_ANY;
+        else if(!strcmp(argv[i], "--")) {
+            ++i;
+            break;
+        }
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if(argc - i > 2) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if(i < argc && strcmp(argv[i], "-")) {
+        input = fopen(argv[i], "rb");
+        if(!input) {
+            perror(argv[i]);
+            return 1;
+        }
+    }
+    if(i + 1 < argc && strcmp(argv[i + 1], "-")) {
+        output = fopen(argv[i + 1], "wb");
+        if(!output) {
+            perror(argv[i + 1]);
+            return 1;
+        }
+    }
+
+    if(to_json)
+        ret = ubjson_convertf_to_json(input, output, flags, &error);
+    else
+        ret = ubjson_convertf_from_json(input, output, flags, &error);
+    if(ret)
+        fprintf(stderr, "%s: %s (byte %d)\n", error.source, error.text, error.position);
+
+    if(to_json && !ret && fputc('\n', output) == EOF)
+        ret = -1;
+    if(fclose(output) && !ret) {
+        perror("write");
+        ret = -1;
+    }
+    if(input != stdin)
+        fclose(input);
+    return ret ? 1 : 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+typedef struct {
+    ubjsonp_scan_t s;
+    const ubjson_limits_t *limits;
+    size_t nodes;
+} validator_t;
+
+#define limit(v, name)  ((v)->limits ? (v)->limits->name : 0)
+
+static int error_at(validator_t *v, size_t pos, const char *msg)
+{
+    v->s.pos = pos;
+    return ubjsonp_scan_error(&v->s, msg);
+}
+
+static int add_nodes(validator_t *v, json_int_t n)
+{
+    size_t max = limit(v, max_nodes);
+
+    if(max && (unsigned long long)n > max - v->nodes)
+        return ubjsonp_scan_error(&v->s, "too many values");
+    v->nodes += n;
+    return 0;
+}
+
+static int check_string(validator_t *v, const char *str, size_t len)
+{
+    size_t start = (const unsigned char *)str - v->s.data;
+    size_t max = limit(v, max_string_length), valid;
+
+    if(max && len > max)
+        return error_at(v, start, "string too long");
+    valid = ubjsonp_utf8_valid((const unsigned char *)str, len);
+    if(valid != len)
+        return error_at(v, start + valid, "invalid UTF-8 string");
+    return 0;
+}
+
+static int validate_value(validator_t *v, int type, size_t depth);
+
+/*
+ * Mirrors the container loop of parse_ubjson_value() in load.c: no-op
+ * elements count as items and values, and keys are checked like strings only when
+ * their value is stored.
+ */
+static int validate_container(validator_t *v, int type, size_t depth)
+{
+    ubjsonp_container_t c;
+    const char *key = NULL;
+    size_t keylen = 0, max_count = limit(v, max_count), max_depth = limit(v, max_depth);
+    size_t max_length = limit(v, max_string_length);
+    json_int_t i;
+    int elem_type, sz, end = (type == '[') ? ']' : '}';
+
+    if(depth >= UBJSONP_MAX_DEPTH || (max_depth && depth >= max_depth))
+        return ubjsonp_scan_error(&v->s, "maximum nesting depth exceeded");
+    if(ubjsonp_scan_open(&v->s, type, &c, v->limits, v->nodes))
+        return -1;
+    /* fixed-size elements are checked in one go, below */
+    sz = (type == '[' && c.count > 0) ? ubjsonp_type_size(c.contained_type) : -1;
+
+    if(sz >= 0) {
+        const unsigned char *p = v->s.data + v->s.pos;
+
+        if(sz && (unsigned long long)c.count > (v->s.len - v->s.pos) / sz)
+            return error_at(v, v->s.len, "premature end of input");
+        v->nodes += c.count;
+        if(c.contained_type == 'C') {
+            for(i = 0; i < c.count; ++i)
+                if(p[i] & 0x80)
+                    return error_at(v, v->s.pos + i, "invalid UTF-8 string");
+        }
+        else if(c.contained_type == 'd' || c.contained_type == 'D') {
+            for(i = 0; i < c.count; ++i)
+                if(!isfinite(ubjsonp_get_real(p + i * sz, c.contained_type)))
+                    return error_at(v, v->s.pos + i * sz, "invalid real number");
+        }
+        v->s.pos += c.count * sz;
+        return 0;
+    }
+
+    for(i = 0; c.count < 0 || i < c.count; ++i) {
+        if(c.count < 0) {
+            if(v->s.pos >= v->s.len)
+                return ubjsonp_scan_error(&v->s, "premature end of input");
+            if(v->s.data[v->s.pos] == end) {
+                v->s.pos++;
+                break;
+            }
+            if(max_count && (unsigned long long)i >= max_count)
+                return ubjsonp_scan_error(&v->s, "too many items");
+        }
+        if(type == '{') {
+            if(ubjsonp_scan_string(&v->s, &key, &keylen))
+                return -1;
+            if(max_length && keylen > max_length)
+                return error_at(v, (const unsigned char *)key - v->s.data, "string too long");
+        }
+        elem_type = c.contained_type ? c.contained_type : ubjsonp_scan_byte(&v->s);
+        if(elem_type == 'N') {
+            if(add_nodes(v, 1))
+                return -1;
+            continue;
+        }
+        if(type == '{') {
+            if(memchr(key, '\0', keylen))
+                return error_at(v, (const unsigned char *)key - v->s.data,
+                                "NUL byte in object key not supported");
+            if(check_string(v, key, keylen))
+                return -1;
+        }
+        if(validate_value(v, elem_type, depth + 1))
+            return -1;
+    }
+    return 0;
+}
+
+static int validate_value(validator_t *v, int type, size_t depth)
+{
+    const char *str;
+    size_t len, max_length = limit(v, max_string_length);
+    int sz;
+
+    if(add_nodes(v, 1))
+        return -1;
+
+    switch(type) {
+        case 'C':
+            if(v->s.pos >= v->s.len)
+                return ubjsonp_scan_error(&v->s, "premature end of input");
+            if(v->s.data[v->s.pos] & 0x80)
+                return ubjsonp_scan_error(&v->s, "invalid UTF-8 string");
+            v->s.pos++;
+            return 0;
+        case 'S':
+            if(ubjsonp_scan_string(&v->s, &str, &len))
+                return -1;
+            return check_string(v, str, len);
+        case 'H':
+            if(ubjsonp_scan_string(&v->s, &str, &len))
+                return -1;
+            if(max_length && len > max_length)
+                return error_at(v, (const unsigned char *)str - v->s.data, "string too long");
+            if(ubjsonp_check_hpn(str, len, NULL) < 0)
+                return error_at(v, (const unsigned char *)str - v->s.data,
+                                "failed parsing high-precision number");
+            return 0;
+        case '[': case '{':
+            return validate_container(v, type, depth);
+        case EOF:
+            return ubjsonp_scan_error(&v->s, "premature end of input");
+    }
+
+    sz = ubjsonp_type_size(type);
+    if(sz < 0)
+        return ubjsonp_scan_error(&v->s, "unrecognized type");
+    if(v->s.len - v->s.pos < (size_t)sz)
+        return error_at(v, v->s.len, "premature end of input");
+    if((type == 'd' || type == 'D') && !isfinite(ubjsonp_get_real(v->s.data + v->s.pos, type)))
+        return ubjsonp_scan_error(&v->s, "invalid real number");
+    v->s.pos += sz;
+    return 0;
+}
+
+ssize_t ubjson_validate(const void *buffer, size_t buflen, size_t flags,
+                        const ubjson_limits_t *limits, json_error_t *error)
+{
+    validator_t v;
+    int type;
+
+    jsonp_error_init(error, "<buffer>");
+
+    if(!buffer) {
+        jsonp_error_set(error, -1, -1, 0, "wrong arguments");
+        return -1;
+    }
+
+    ubjsonp_scan_init(&v.s, buffer, buflen, error);
+    v.limits = limits;
+    v.s.max_hpn_length = limit(&v, max_string_length);
+    v.nodes = 0;
+
+    if(!(flags & JSON_DECODE_ANY)) {
+        type = ubjsonp_scan_byte(&v.s);
+        if(type != '[' && type != '{')
+            return error_at(&v, 0, "'[' or '{' expected");
+    }
+    else
+        type = ubjsonp_scan_marker(&v.s);
+
+    if(validate_value(&v, type, 0))
+        return -1;
+
+    if(!(flags & JSON_DISABLE_EOF_CHECK) && v.s.pos != v.s.len)
+        return ubjsonp_scan_error(&v.s, "end of file expected");
+    return v.s.pos;
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2015 Luke Dashjr <luke-jr+jansson@utopios.org>
+ *
+ * Jansson is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT license. See LICENSE for details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <jansson.h>
+
+#include "ubjansson.h"
+#include "jansson_private.h"
+
+typedef struct {
+    int type;            /* '[' or '{' */
+    int contained_type;  /* 0 unless the container uses '$' */
+    json_int_t count;    /* elements left, or -1 if unsized */
+    int need_value;      /* objects: a key has been written */
+} frame_t;
+
+struct ubjson_writer {
+    json_dump_callback_t dump;
+    void *data;
+    struct ubjsonp_dumpb_data buffer;
+    size_t written;
+    frame_t *stack;
+    size_t depth;
+    size_t stack_size;
+    int done;    /* the top-level value is complete */
+    int failed;
+};
+
+static int writer_write(const char *buffer, size_t size, void *data)
+{
+    ubjson_writer_t *writer = data;
+
+    if(writer->dump(buffer, size, writer->data))
+        return -1;
+    writer->written += size;
+    return 0;
+}
+
+static int fail(ubjson_writer_t *writer)
+{
+    writer->failed = 1;
+    return -1;
+}
+
+static frame_t *top(ubjson_writer_t *writer)
+{
+    return writer->depth ? &writer->stack[writer->depth - 1] : NULL;
+}
+
+/* Checks that a value may come next and writes its marker, which typed
+   containers leave out */
+static int begin_value(ubjson_writer_t *writer, int marker)
+{
+    frame_t *f = top(writer);
+
+    if(writer->failed)
+        return -1;
+    if(!f && writer->done)
+        return fail(writer);
+    if(f) {
+        if(f->type == '{' && !f->need_value)
+            return fail(writer);
+        if(f->count == 0)
+            return fail(writer);
+        if(f->contained_type) {
+            if(f->contained_type != marker)
+                return fail(writer);
+            return 0;
+        }
+    }
+    if(marker) {
+        char c = marker;
+        if(writer_write(&c, 1, writer))
+            return fail(writer);
+    }
+    return 0;
+}
+
+static void end_value(ubjson_writer_t *writer)
+{
+    frame_t *f = top(writer);
+
+    if(!f) {
+        writer->done = 1;
+        return;
+    }
+    if(f->count > 0)
+        f->count--;
+    f->need_value = 0;
+}
+
+static ubjson_writer_t *writer_new(json_dump_callback_t callback, void *data)
+{
+    ubjson_writer_t *writer = calloc(1, sizeof(*writer));
+
+    if(!writer)
+        return NULL;
+    writer->dump = callback;
+    writer->data = data;
+    return writer;
+}
+
+ubjson_writer_t *ubjson_writer_new(json_dump_callback_t callback, void *data)
+{
+    if(!callback)
+        return NULL;
+    return writer_new(callback, data);
+}
+
+ubjson_writer_t *ubjson_writer_new_buffer(void *buffer, size_t buflen)
+{
+    ubjson_writer_t *writer = writer_new(ubjsonp_dumpb_callback, NULL);
+
+    if(!writer)
+        return NULL;
+    writer->buffer.p = buffer;
+    writer->buffer.rem = buffer ? buflen : 0;
+    writer->buffer.sz = 0;
+    writer->data = &writer->buffer;
+    return writer;
+}
+
+size_t ubjson_writer_size(const ubjson_writer_t *writer)
+{
+    return writer->written;
+}
+
+int ubjson_writer_close(ubjson_writer_t *writer)
+{
+    int ret;
+
+    if(!writer)
+        return -1;
+    ret = (writer->failed || writer->depth) ? -1 : 0;
+    free(writer->stack);
+    free(writer);
+    return ret;
+}
+
+static int begin_container(ubjson_writer_t *writer, int type, int contained_type, ssize_t count)
+{
+    unsigned char head[4];
+    size_t len = 0;
+    frame_t *f;
+
+    /* '$' needs a count, and a type the writer can produce */
+    if(contained_type && (count < 0 || !strchr("ZTFiUIlLdDS[{", contained_type)))
+        return fail(writer);
+    if(begin_value(writer, type))
+        return -1;
+
+    if(writer->depth == writer->stack_size) {
+        size_t size = writer->stack_size ? writer->stack_size * 2 : 8;
+        frame_t *stack;
+
+        if(size > UBJSONP_MAX_DEPTH)
+            size = UBJSONP_MAX_DEPTH;
+        if(writer->depth == size)
+            return fail(writer);
+        stack = realloc(writer->stack, size * sizeof(frame_t));
+        if(!stack)
+            return fail(writer);
+        writer->stack = stack;
+        writer->stack_size = size;
+    }
+
+    if(contained_type) {
+        head[len++] = '$';
+        head[len++] = contained_type;
+    }
+    if(count >= 0)
+        head[len++] = '#';
+    if(len && writer_write((char *)head, len, writer))
+        return fail(writer);
+    if(count >= 0 && ubjsonp_dump_int(count, writer_write, writer))
+        return fail(writer);
+
+    f = &writer->stack[writer->depth++];
+    f->type = type;
+    f->contained_type = contained_type;
+    f->count = count;
+    f->need_value = 0;
+    return 0;
+}
+
+static int end_container(ubjson_writer_t *writer, int type)
+{
+    frame_t *f = top(writer);
+
+    if(writer->failed)
+        return -1;
+    if(!f || f->type != type || f->need_value || f->count > 0)
+        return fail(writer);
+    if(f->count < 0) {
+        char c = (type == '[') ? ']' : '}';
+        if(writer_write(&c, 1, writer))
+            return fail(writer);
+    }
+    writer->depth--;
+    end_value(writer);
+    return 0;
+}
+
+int ubjson_writer_begin_array(ubjson_writer_t *writer, int type, ssize_t count)
+{
+    return begin_container(writer, '[', type, count);
+}
+
+int ubjson_writer_end_array(ubjson_writer_t *writer)
+{
+    return end_container(writer, '[');
+}
+
+int ubjson_writer_begin_object(ubjson_writer_t *writer, int type, ssize_t count)
+{
+    return begin_container(writer, '{', type, count);
+}
+
+int ubjson_writer_end_object(ubjson_writer_t *writer)
+{
+    return end_container(writer, '{');
+}
+
+int ubjson_writer_key(ubjson_writer_t *writer, const char *key, size_t len)
+{
+    frame_t *f = top(writer);
+
+    if(writer->failed)
+        return -1;
+    if(!f || f->type != '{' || f->need_value || f->count == 0)
+        return fail(writer);
+    if(ubjsonp_dump_buf(key, len, writer_write, writer))
+        return fail(writer);
+    f->need_value = 1;
+    return 0;
+}
+
+int ubjson_writer_null(ubjson_writer_t *writer)
+{
+    if(begin_value(writer, 'Z'))
+        return -1;
+    end_value(writer);
+    return 0;
+}
+
+int ubjson_writer_bool(ubjson_writer_t *writer, int value)
+{
+    if(begin_value(writer, value ? 'T' : 'F'))
+        return -1;
+    end_value(writer);
+    return 0;
+}
+
+int ubjson_writer_int(ubjson_writer_t *writer, json_int_t value)
+{
+    frame_t *f = top(writer);
+    int type = (f && f->contained_type) ? f->contained_type : 0;
+
+    if(type == 'd' || type == 'D')
+        return ubjson_writer_real(writer, value);
+    if(type) {
+        unsigned char buf[8];
+
+        /* typed containers hold the bare payload */
+        if(!ubjsonp_int_fits(type, value))
+            return fail(writer);
+        if(begin_value(writer, type))
+            return -1;
+        ubjsonp_put_int(buf, type, value);
+        if(writer_write((char *)buf, ubjsonp_type_size(type), writer))
+            return fail(writer);
+    }
+    else {
+        if(begin_value(writer, 0))
+            return -1;
+        if(ubjsonp_dump_int(value, writer_write, writer))
+            return fail(writer);
+    }
+    end_value(writer);
+    return 0;
+}
+
+int ubjson_writer_real(ubjson_writer_t *writer, double value)
+{
+    frame_t *f = top(writer);
+    int type = (f && f->contained_type) ? f->contained_type : 0;
+
+    if(type == 'd' || type == 'D') {
+        unsigned char buf[8];
+
+        /* typed containers hold the bare payload */
+        if(begin_value(writer, type))
+            return -1;
+        ubjsonp_put_real(buf, type, value);
+        if(writer_write((char *)buf, ubjsonp_type_size(type), writer))
+            return fail(writer);
+    }
+    else {
+        /* the same bytes ubjson_dump_callback() writes for a real */
+        if(begin_value(writer, 0))
+            return -1;
+        if(ubjsonp_dump_real(value, writer_write, writer))
+            return fail(writer);
+    }
+    end_value(writer);
+    return 0;
+}
+
+int ubjson_writer_string(ubjson_writer_t *writer, const char *value, size_t len)
+{
+    if(begin_value(writer, 'S'))
+        return -1;
+    if(ubjsonp_dump_buf(value, len, writer_write, writer))
+        return fail(writer);
+    end_value(writer);
+    return 0;
+}
+
+int ubjson_writer_json(ubjson_writer_t *writer, json_t *json, size_t flags)
+{
+    if(!json)
+        return fail(writer);
+    /* typed containers have no room for a marker, so this fails there */
+    if(begin_value(writer, 0))
+        return -1;
+    if(ubjson_dump_callback(json, writer_write, writer, flags | JSON_ENCODE_ANY))
+        return fail(writer);
+    end_value(writer);
+    return 0;
+}
+
+int ubjson_writer_typed_array(ubjson_writer_t *writer, int type, const void *values, size_t count)
+{
+    if(begin_value(writer, 0))
+        return -1;
+    if(ubjson_dump_typed_array(type, values, count, writer_write, writer))
+        return fail(writer);
+    end_value(writer);
+    return 0;
+}
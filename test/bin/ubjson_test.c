@@ -6,6 +6,7 @@
  */
 
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -81,6 +82,1046 @@ static void test3(json_t *json, int result, const char *binraw, const char *test
     }  \
 } while(0)
 
+#define check(x)  do {  \
+    if(x)  \
+        ++passed;  \
+    else  \
+    {  \
+        fprintf(stderr, "FAILED %s line %d: %s\n", __func__, __LINE__, #x);  \
+        ++failed;  \
+    }  \
+} while(0)
+
+struct membuf {
+    char *p;
+    size_t len;
+    size_t pos;
+    size_t chunk;
+};
+
+static size_t membuf_read(void *buffer, size_t buflen, void *data)
+{
+    struct membuf *mb = data;
+    size_t n = mb->len - mb->pos;
+
+    if(n > buflen)
+        n = buflen;
+    if(mb->chunk && n > mb->chunk)
+        n = mb->chunk;
+    memcpy(buffer, mb->p + mb->pos, n);
+    mb->pos += n;
+    return n;
+}
+
+static int membuf_write(const char *buffer, size_t size, void *data)
+{
+    struct membuf *mb = data;
+
+    mb->p = realloc(mb->p, mb->len + size + 1);
+    memcpy(mb->p + mb->len, buffer, size);
+    mb->len += size;
+    mb->p[mb->len] = '\0';
+    return 0;
+}
+
+static void test_convert(const char *text, const void *bin, size_t binsz)
+{
+    json_error_t err;
+    json_t *expected, *json;
+    struct membuf in, out;
+
+    expected = json_loads(text, JSON_DECODE_ANY, &err);
+
+    /* JSON text -> UBJSON, read back with ubjson_loadb */
+    memset(&in, 0, sizeof(in));
+    memset(&out, 0, sizeof(out));
+    in.p = (char *)text;
+    in.len = strlen(text);
+    in.chunk = 3;
+    if(ubjson_convert_from_json(membuf_read, &in, membuf_write, &out, JSON_DECODE_ANY, &err))
+    {
+        fprintf(stderr, "FAILED convert from JSON %s: %s\n", text, err.text);
+        ++failed;
+    }
+    else
+    {
+        json = ubjson_loadb(out.p, out.len, JSON_DECODE_ANY, &err);
+        if(json_equal(json, expected))
+            ++passed;
+        else
+        {
+            fprintf(stderr, "FAILED converted UBJSON mismatch %s\n", text);
+            ++failed;
+        }
+        json_decref(json);
+    }
+    free(out.p);
+
+    /* UBJSON -> JSON text, read back with json_loads */
+    memset(&in, 0, sizeof(in));
+    memset(&out, 0, sizeof(out));
+    in.p = (char *)bin;
+    in.len = binsz;
+    in.chunk = 2;
+    if(ubjson_convert_to_json(membuf_read, &in, membuf_write, &out, JSON_DECODE_ANY, &err))
+    {
+        fprintf(stderr, "FAILED convert to JSON %s: %s\n", text, err.text);
+        ++failed;
+    }
+    else
+    {
+        json = json_loads(out.p, JSON_DECODE_ANY, &err);
+        if(json_equal(json, expected))
+            ++passed;
+        else
+        {
+            fprintf(stderr, "FAILED converted JSON mismatch %s: %s\n", text, out.p);
+            ++failed;
+        }
+        json_decref(json);
+    }
+    free(out.p);
+    json_decref(expected);
+}
+
+#define test_convert(text, bin)  test_convert(text, bin, sizeof(bin)-1)
+
+typedef int (*convert_func)(json_load_callback_t, void *, json_dump_callback_t, void *, size_t, json_error_t *);
+
+static int convert_buffer(convert_func func, const char *p, size_t len, json_error_t *err)
+{
+    struct membuf in, out;
+    int ret;
+
+    memset(&in, 0, sizeof(in));
+    memset(&out, 0, sizeof(out));
+    in.p = (char *)p;
+    in.len = len;
+    ret = func(membuf_read, &in, membuf_write, &out, JSON_DECODE_ANY, err);
+    free(out.p);
+    return ret;
+}
+
+static void test_convert_errors(void)
+{
+    char deep[5000];
+    json_error_t err;
+
+#define to_json(bin)  convert_buffer(ubjson_convert_to_json, bin, sizeof(bin) - 1, &err)
+#define from_json(text)  convert_buffer(ubjson_convert_from_json, text, strlen(text), &err)
+
+    /* high-precision numbers must be JSON numbers */
+    check(to_json("[Hi\x02+1]") == -1 && !strcmp(err.text, "failed parsing high-precision number"));
+    check(to_json("[Hi\x03""1..]") == -1);
+    check(to_json("[Hi\x01""e]") == -1);
+    check(to_json("[Hi\x00]") == -1);
+    check(to_json("[Hi\x06""-0.5e3]") == 0);
+    check(to_json("[Hi\x03""1.0]") == 0);
+
+    /* lengths and counts as load.c reads them */
+    check(to_json("[SHi\x01""3abc]") == 0);
+    check(to_json("[#Hi\x01""2ZZ") == 0);
+    check(to_json("[SHi\x03""1.0abc]") == -1 && !strcmp(err.text, "non-integer size"));
+    check(to_json("[$N#L\x7f\xff\xff\xff\xff\xff\xff\xff]") == -1 && !strcmp(err.text, "too many items"));
+    check(to_json("[$Z#L\x7f\xff\xff\xff\xff\xff\xff\xff]") == -1 && !strcmp(err.text, "too many items"));
+    check(to_json("[$N#l\x00\x0f\x00\x00") == 0);
+
+    /* keys are strings too */
+    check(to_json("{#i\x01i\x01\xffZ") == -1 && !strcmp(err.text, "invalid UTF-8 in object key"));
+
+    check(from_json("[\"a\\u0000b\"]") == -1);
+
+    memset(deep, '[', sizeof(deep));
+    check(convert_buffer(ubjson_convert_to_json, deep, sizeof(deep), &err) == -1 &&
+          !strcmp(err.text, "maximum nesting depth exceeded"));
+    check(convert_buffer(ubjson_convert_from_json, deep, sizeof(deep), &err) == -1 &&
+          !strcmp(err.text, "maximum nesting depth exceeded"));
+}
+
+static void test_recfile(void)
+{
+    const char *path = "ubjson_test.rec";
+    ubjson_recfile_writer_t *writer;
+    ubjson_recfile_t *recfile;
+    json_error_t err;
+    json_t *json;
+    char key[16];
+    const char *min_key, *max_key;
+    size_t i, first, len;
+
+    /* two sessions, so the second one has to resume the index */
+    for(i = 0; i < 10; ++i)
+    {
+        if(i == 0 || i == 6)
+        {
+            if(i)
+                check(!ubjson_recfile_writer_close(writer));
+            writer = ubjson_recfile_writer_open(path, 4, &err);
+            if(!writer)
+            {
+                fprintf(stderr, "FAILED recfile writer open: %s\n", err.text);
+                ++failed;
+                return;
+            }
+        }
+        json = json_pack("{si}", "n", (int)i);
+        snprintf(key, sizeof(key), "k%02d", (int)(9 - i));
+        check(!ubjson_recfile_append(writer, json, (i % 3) ? key : NULL, 0));
+        json_decref(json);
+    }
+
+    /* until the writer is closed, the file still holds the first session */
+    recfile = ubjson_recfile_open(path, &err);
+    check(recfile && ubjson_recfile_count(recfile) == 6);
+    ubjson_recfile_close(recfile);
+    check(!ubjson_recfile_writer_close(writer));
+
+    recfile = ubjson_recfile_open(path, &err);
+    if(!recfile)
+    {
+        fprintf(stderr, "FAILED recfile open: %s\n", err.text);
+        ++failed;
+        remove(path);
+        return;
+    }
+
+    check(ubjson_recfile_count(recfile) == 10);
+    for(i = 10; i-- > 0; )
+    {
+        json = ubjson_recfile_get(recfile, i, 0, &err);
+        check(json && json_integer_value(json_object_get(json, "n")) == (json_int_t)i);
+        json_decref(json);
+    }
+    check(!ubjson_recfile_record(recfile, 10, &len));
+    check(ubjson_recfile_record(recfile, 0, &first) != NULL);
+    check(ubjson_recfile_range(recfile, 2, 3, &len) != NULL && len == 3 * first);
+
+    /* keys k08 k07 | k05 k04 k02 | k01 */
+    check(ubjson_recfile_blocks(recfile) == 3);
+    check(!ubjson_recfile_block(recfile, 1, &first, &min_key, &max_key) &&
+          first == 4 && !strcmp(min_key, "k02") && !strcmp(max_key, "k05"));
+    check(!ubjson_recfile_block(recfile, 2, &first, &min_key, &max_key) &&
+          first == 8 && !strcmp(min_key, "k01") && !strcmp(max_key, "k01"));
+
+    ubjson_recfile_close(recfile);
+    remove(path);
+
+    /* a failed append after resuming keeps the earlier records */
+    writer = ubjson_recfile_writer_open(path, 4, &err);
+    json = json_integer(1);
+    check(writer && !ubjson_recfile_append_raw(writer, "[]", 2, "b"));
+    check(!ubjson_recfile_append_raw(writer, "{}", 2, "a"));
+    check(!ubjson_recfile_writer_close(writer));
+    writer = ubjson_recfile_writer_open(path, 2, &err);
+    check(writer && ubjson_recfile_append(writer, json, "z", 0) == -1);
+    check(!ubjson_recfile_append(writer, json, "c", JSON_ENCODE_ANY));
+    check(!ubjson_recfile_writer_close(writer));
+    json_decref(json);
+
+    recfile = ubjson_recfile_open(path, &err);
+    check(recfile && ubjson_recfile_count(recfile) == 3);
+    if(recfile)
+    {
+        json = ubjson_recfile_get(recfile, 2, JSON_DECODE_ANY, &err);
+        check(json_integer_value(json) == 1);
+        json_decref(json);
+        check(ubjson_recfile_blocks(recfile) == 1);
+        check(!ubjson_recfile_block(recfile, 0, &first, &min_key, &max_key) &&
+              first == 0 && !strcmp(min_key, "a") && !strcmp(max_key, "c"));
+        ubjson_recfile_close(recfile);
+    }
+    remove(path);
+}
+
+static void test_recfile_invalid(void)
+{
+    const char *path = "ubjson_test.rec";
+    char doc[64];
+    json_error_t err;
+    FILE *F;
+
+    F = fopen(path, "wb");
+    check(F && fwrite("UBJREC1\n", 8, 1, F) == 1);
+    if(F)
+        fclose(F);
+    check(!ubjson_recfile_open(path, &err) && !strcmp(err.text, "not a UBJSON record file"));
+    check(!ubjson_recfile_writer_open(path, 4, &err));
+
+    memset(doc, 'Z', sizeof(doc));
+    doc[0] = '[';
+    doc[sizeof(doc) - 1] = ']';
+    F = fopen(path, "wb");
+    check(F && fwrite(doc, sizeof(doc), 1, F) == 1);
+    if(F)
+        fclose(F);
+    check(!ubjson_recfile_open(path, &err) && !strcmp(err.text, "not a UBJSON record file"));
+    check(!ubjson_recfile_writer_open(path, 4, &err));
+    remove(path);
+}
+
+static void test_patch(void)
+{
+    unsigned char buf[0x200];
+    json_error_t err;
+    json_t *json, *value;
+    ssize_t len, len2;
+
+    json = json_loads("{\"count\": 5, \"flag\": true, \"name\": \"ab\", \"a/b\": [1, \"x\", null], \"z\": 0}", 0, &err);
+    len = ubjson_dumpb(json, buf, sizeof(buf), 0);
+    json_decref(json);
+
+    /* same width: rewritten in place */
+    value = json_integer(6);
+    len2 = ubjson_patch(buf, len, sizeof(buf), "/count", value, &err);
+    json_decref(value);
+    check(len2 == len);
+
+    value = json_false();
+    check(ubjson_patch(buf, len, sizeof(buf), "/flag", value, &err) == len);
+
+    /* wider values splice the rest of the document */
+    value = json_string("abcdef");
+    len2 = ubjson_patch(buf, len, sizeof(buf), "/name", value, &err);
+    json_decref(value);
+    check(len2 == len + 4);
+    len = len2;
+
+    value = json_real(0.5);
+    check((len = ubjson_patch(buf, len, sizeof(buf), "/a~1b/1", value, &err)) > 0);
+    json_decref(value);
+
+    /* shrinking */
+    value = json_null();
+    len2 = ubjson_patch(buf, len, sizeof(buf), "/z", value, &err);
+    check(len2 == len - 8);
+    len = len2;
+
+    /* errors leave the buffer alone */
+    value = json_integer(1);
+    check(ubjson_patch(buf, len, sizeof(buf), "/missing", value, &err) == -1);
+    check(ubjson_patch(buf, len, sizeof(buf), "/a~1b", value, &err) == -1);
+    check(ubjson_patch(buf, len, sizeof(buf), "/a~2b/1", value, &err) == -1 && !strcmp(err.text, "invalid path"));
+    check(ubjson_patch(buf, len, sizeof(buf), "/a~", value, &err) == -1 && !strcmp(err.text, "invalid path"));
+    json_decref(value);
+    value = json_string("longer than before");
+    check(ubjson_patch(buf, len, len, "/name", value, &err) == -1);
+    json_decref(value);
+
+    json = ubjson_loadb(buf, len, 0, &err);
+    value = json_loads("{\"count\": 6, \"flag\": false, \"name\": \"abcdef\", \"a/b\": [1, 0.5, null], \"z\": null}", 0, &err);
+    check(json_equal(json, value));
+    json_decref(json);
+    json_decref(value);
+
+    /* typed containers keep their element type */
+    memcpy(buf, "[$U#i\x03\x01\x02\x03", 9);
+    value = json_integer(200);
+    check(ubjson_patch(buf, 9, sizeof(buf), "/2", value, &err) == 9 && buf[8] == 200);
+    json_decref(value);
+    value = json_integer(-1);
+    check(ubjson_patch(buf, 9, sizeof(buf), "/0", value, &err) == -1);
+    json_decref(value);
+
+    /* elements of zero-width types are found without walking the count */
+    value = json_null();
+    memcpy(buf, "[$N#L\x7f\xff\xff\xff\xff\xff\xff\xff", 13);
+    check(ubjson_patch(buf, 13, sizeof(buf), "/5", value, &err) == -1 && !strcmp(err.text, "too many items"));
+    memcpy(buf, "[$N#L\x00\x00\x00\x00\x00\x0f\x00\x00", 13);
+    check(ubjson_patch(buf, 13, sizeof(buf), "/5", value, &err) == -1 && !strcmp(err.text, "path not found"));
+    memcpy(buf, "[$Z#L\x00\x00\x00\x00\x00\x0f\x00\x00", 13);
+    check(ubjson_patch(buf, 13, sizeof(buf), "/983039", value, &err) == 13);
+    check(ubjson_patch(buf, 13, sizeof(buf), "/983040", value, &err) == -1 && !strcmp(err.text, "path not found"));
+    json_decref(value);
+}
+
+struct sample {
+    int32_t id;
+    uint8_t level;
+    double ratio;
+    float scale;
+    int enabled;
+    char name[8];
+    int16_t samples[4];
+    size_t nsamples;
+};
+
+static const ubjson_field_t sample_fields[] = {
+    UBJSON_FIELD(struct sample, id, UBJSON_TYPE_INT32),
+    UBJSON_FIELD(struct sample, level, UBJSON_TYPE_UINT8),
+    UBJSON_FIELD(struct sample, ratio, UBJSON_TYPE_FLOAT64),
+    UBJSON_FIELD(struct sample, scale, UBJSON_TYPE_FLOAT32),
+    UBJSON_FIELD(struct sample, enabled, UBJSON_TYPE_BOOL),
+    UBJSON_FIELD(struct sample, name, UBJSON_TYPE_STRING),
+    UBJSON_FIELD_ARRAY(struct sample, samples, UBJSON_TYPE_INT16, nsamples),
+};
+
+#define NSAMPLE_FIELDS  (sizeof(sample_fields) / sizeof(sample_fields[0]))
+
+static void test_struct(void)
+{
+    struct sample in = { -7, 200, 0.25, 1.5f, 1, "abc", { 1, -2, 300 }, 3 };
+    struct sample out;
+    unsigned char buf[0x100];
+    json_error_t err;
+    json_t *json;
+    ssize_t len;
+
+    /* encoder output is plain UBJSON */
+    len = ubjson_dumpb_struct(&in, sample_fields, NSAMPLE_FIELDS, buf, sizeof(buf));
+    json = ubjson_loadb(buf, len, 0, &err);
+    check(json_integer_value(json_object_get(json, "id")) == -7);
+    check(json_real_value(json_object_get(json, "scale")) == 1.5);
+    check(json_array_size(json_object_get(json, "samples")) == 3);
+    json_decref(json);
+
+    memset(&out, 0, sizeof(out));
+    check(!ubjson_loadb_struct(buf, len, sample_fields, NSAMPLE_FIELDS, &out, 0, &err));
+    check(out.id == -7 && out.level == 200 && out.ratio == 0.25 && out.scale == 1.5f);
+    check(out.enabled == 1 && !strcmp(out.name, "abc"));
+    check(out.nsamples == 3 && out.samples[1] == -2 && out.samples[2] == 300);
+
+#define load_sample(bin)  ubjson_loadb_struct(bin, sizeof(bin) - 1, sample_fields, NSAMPLE_FIELDS, &out, 0, &err)
+
+    /* generic encodings, unknown keys and out-of-order fields */
+    memset(&out, 0, sizeof(out));
+    check(!load_sample("{i\x07samples[i\x05U\x06]i\x05""extra[{}]i\x02idHi\x02""42i\x05ratioi\x03}"));
+    check(out.id == 42 && out.ratio == 3.0 && out.nsamples == 2 && out.samples[1] == 6);
+
+    /* bounds are enforced */
+    check(load_sample("{i\x05levelI\x01\x00}") == -1);
+    check(load_sample("{i\x04nameSi\x08""12345678}") == -1);
+    check(load_sample("{i\x07samples[$i#i\x05\1\2\3\4\5}") == -1);
+    check(load_sample("{i\x07samples[$N#L\x7f\xff\xff\xff\xff\xff\xff\xff}") == -1);
+    check(!strcmp(err.text, "samples: too many items"));
+    check(load_sample("{i\x02idHi\x04""0x10}") == -1);
+}
+
+static void *failing_malloc(size_t size)
+{
+    (void)size;
+    return NULL;
+}
+
+static void test_validate(void)
+{
+    ubjson_limits_t limits;
+    json_error_t err;
+
+#define validate(bin, flags, limits)  ubjson_validate(bin, sizeof(bin) - 1, flags, limits, &err)
+
+    check(validate("{i\x02""ab[$U#i\x03\1\2\3i\x01""cHi\x02""42}", 0, NULL) == 23);
+    check(validate("[SHi\x01""3abcC\x41]", 0, NULL) == 12);
+    check(validate("[]Z", JSON_DISABLE_EOF_CHECK, NULL) == 2);
+    check(validate("Z", JSON_DECODE_ANY, NULL) == 1);
+    check(validate("[$Z#I\x10\0", 0, NULL) == 7);
+
+    check(validate("Z", 0, NULL) == -1 && err.position == 0);
+    check(validate("[]Z", 0, NULL) == -1 && err.position == 2);
+    check(validate("[$I#i\x03\0\1", 0, NULL) == -1 && err.position == 8);
+    check(validate("[Si\x02\xc3\x28]", 0, NULL) == -1 && err.position == 4);
+    check(validate("[Si\x03""a\xed\xa0]", 0, NULL) == -1 && err.position == 5);
+    check(validate("[$C#i\x02""a\xe9", 0, NULL) == -1 && err.position == 7);
+    check(validate("[Hi\x02""1.]", 0, NULL) == -1);
+    check(validate("[X]", 0, NULL) == -1 && !strcmp(err.text, "unrecognized type"));
+    check(validate("[$Z#L\x7f\xff\xff\xff\xff\xff\xff\xff", 0, NULL) == -1 &&
+          !strcmp(err.text, "too many items"));
+
+    memset(&limits, 0, sizeof(limits));
+    limits.max_depth = 3;
+    check(validate("[[[]]]", 0, &limits) == 6);
+    limits.max_depth = 2;
+    check(validate("[[[]]]", 0, &limits) == -1 && err.position == 3);
+
+    memset(&limits, 0, sizeof(limits));
+    limits.max_count = 2;
+    check(validate("[ZZ]", 0, &limits) == 4);
+    check(validate("[ZZZ]", 0, &limits) == -1);
+    check(validate("[$U#I\x10\0", 0, &limits) == -1 && !strcmp(err.text, "too many items"));
+
+    memset(&limits, 0, sizeof(limits));
+    limits.max_string_length = 2;
+    check(validate("{i\x02""abSi\x02""cd}", 0, &limits) == 11);
+    check(validate("[Si\x03""abc]", 0, &limits) == -1 && err.position == 4);
+
+    memset(&limits, 0, sizeof(limits));
+    limits.max_nodes = 4;
+    check(validate("[ZZZ]", 0, &limits) == 5);
+    check(validate("[ZZZZ]", 0, &limits) == -1);
+    check(validate("[ZNNZ]", 0, &limits) == -1);
+    check(validate("[$N#i\x04", 0, &limits) == -1 && !strcmp(err.text, "too many values"));
+    check(validate("[$Z#L\x7f\xff\xff\xff\xff\xff\xff\xff", 0, &limits) == -1);
+
+    /* nothing is allocated, not even for high-precision numbers */
+    json_set_alloc_funcs(failing_malloc, free);
+    check(validate("[Hi\x03""1.5Hi\x02""42SHi\x01""2ab{$i#Hi\x01""1i\x01""k\x01]", 0, NULL) == 32);
+    check(validate("[Hi\x05""1e999]", 0, NULL) == -1);
+    json_set_alloc_funcs(malloc, free);
+}
+
+/* ubjson_validate() accepts exactly what ubjson_loadb() does */
+static void test_validate_agrees(void)
+{
+    static const struct {
+        const char *bin;
+        size_t len;
+    } docs[] = {
+#define doc(bin)  { bin, sizeof(bin) - 1 }
+        doc("[Hi\x05""1e999]"),
+        doc("[Hi\x05""1e-99]"),
+        doc("[Hi\x03"" 42]"),
+        doc("[Hi\x02""1\0]"),
+        doc("[Hi\x02""+1]"),
+        doc("[Hi\x02""01]"),
+        doc("[Hi\x14""99999999999999999999]"),
+        doc("[SHi\x02"" 3abc]"),
+        doc("[#Hi\x02""-0"),
+        doc("[#Hi\x03""1.0Z"),
+        doc("[\0Z]"),
+        doc("[Z\0]"),
+        doc("[$\0#i\x01Z"),
+        doc("[Si\x03""a\0b]"),
+        doc("[Si\x03""a\0\xff]"),
+        doc("{i\x02""a\0Z}"),
+        doc("{i\x01\xffN}"),
+        doc("[D\x7f\xf0\0\0\0\0\0\0]"),
+        doc("[d\x7f\x80\0\0]"),
+        doc("[$d#i\x01\xff\xc0\0\0"),
+        doc("{i\x02""abN}"),
+        doc("[NZ]"),
+        doc("[#i\x03NNZ"),
+        doc("[$N#i\x05"),
+        doc("{$N#i\x02i\x01""ai\x01""b"),
+#undef doc
+    };
+    ubjson_limits_t limits;
+    ubjson_load_opts_t opts;
+    json_error_t err;
+    json_t *json;
+    ssize_t len;
+    unsigned int i, limited;
+
+    memset(&limits, 0, sizeof(limits));
+    limits.max_count = 1;
+    limits.max_string_length = 1;
+    limits.max_nodes = 2;
+    opts.intern = NULL;
+
+    for(limited = 0; limited < 2; ++limited) {
+        opts.limits = limited ? &limits : NULL;
+        for(i = 0; i < sizeof(docs) / sizeof(docs[0]); ++i) {
+            json = ubjson_loadb_opts((void *)docs[i].bin, docs[i].len, 0, &opts, &err);
+            len = ubjson_validate(docs[i].bin, docs[i].len, 0, opts.limits, &err);
+            if(!json != (len < 0))
+                fprintf(stderr, "load and validate disagree on docs[%u], limited %u\n", i, limited);
+            check(!json == (len < 0));
+            json_decref(json);
+        }
+    }
+}
+
+static void test_limits(void)
+{
+    ubjson_limits_t limits;
+    ubjson_load_opts_t opts;
+    unsigned char buf[0x1005];
+    json_error_t err;
+    json_t *json;
+    FILE *F;
+
+    memset(&limits, 0, sizeof(limits));
+    opts.limits = &limits;
+
+    /* declared lengths and counts are checked against the input first */
+    json = ubjson_loadb("[Sl\x7f\xff\xff\xff]", 7, 0, &err);
+    check(!json && !strcmp(err.text, "premature end of input") && err.position == 7);
+    json = ubjson_loadb("[$l#l\x7f\xff\xff\xff", 9, 0, &err);
+    check(!json && !strcmp(err.text, "premature end of input"));
+    json = ubjson_loadb("{#l\x7f\xff\xff\xff", 7, 0, &err);
+    check(!json && !strcmp(err.text, "premature end of input"));
+    json = ubjson_loadb("[i\x05X]", 5, 0, &err);
+    check(!json && !strcmp(err.text, "unrecognized type") && err.position == 4);
+
+    F = tmpfile();
+    if(F && fwrite("[SL\0\0\0\x10\0\0\0\0ab", 13, 1, F) == 1) {
+        rewind(F);
+        json = ubjson_loadf(F, 0, &err);
+        check(!json && !strcmp(err.text, "premature end of input") && err.position == 13);
+    }
+    else
+        check(!"tmpfile");
+    if(F)
+        fclose(F);
+
+    /* zero-width elements are bounded even without limits */
+    json = ubjson_loadb("[$Z#l\x7f\xff\xff\xff", 9, 0, &err);
+    check(!json && !strcmp(err.text, "too many items"));
+    json = ubjson_loadb("[$N#l\x7f\xff\xff\xff", 9, 0, &err);
+    check(!json && !strcmp(err.text, "too many items"));
+    json = ubjson_loadb("[$N#L\x7f\xff\xff\xff\xff\xff\xff\xff", 13, 0, &err);
+    check(!json && !strcmp(err.text, "too many items"));
+    json = ubjson_loadb("[$N#l\0\x10\0\0", 9, 0, &err);
+    check(json_is_array(json) && json_array_size(json) == 0);
+    json_decref(json);
+    json = ubjson_loadb("[$T#l\0\x10\0\0", 9, 0, &err);
+    check(json_array_size(json) == 0x100000);
+    json_decref(json);
+
+    limits.max_count = 0x1000;
+    json = ubjson_loadb_opts("[$Z#l\x7f\xff\xff\xff", 9, 0, &opts, &err);
+    check(!json && !strcmp(err.text, "too many items"));
+    json = ubjson_loadb_opts("[$Z#I\x10\0", 7, 0, &opts, &err);
+    check(json_array_size(json) == 0x1000);
+    json_decref(json);
+
+    memcpy(buf, "[#I\x10\0", 5);
+    memset(buf + 5, 'T', 0x1000);
+    json = ubjson_loadb_opts(buf, 0x1005, 0, &opts, &err);
+    check(json_array_size(json) == 0x1000);
+    json_decref(json);
+    buf[5] = '[';
+    buf[6] = ']';
+    limits.max_nodes = 0x1000;
+    json = ubjson_loadb_opts(buf, 0x1005, 0, &opts, &err);
+    check(!json && !strcmp(err.text, "too many values"));
+
+    /* no-op elements count against the limits */
+    json = ubjson_loadb_opts("[$N#I\x10\0", 7, 0, &opts, &err);
+    check(!json && !strcmp(err.text, "too many values"));
+    limits.max_nodes = 3;
+    json = ubjson_loadb_opts("[ZNN]", 5, 0, &opts, &err);
+    check(!json && !strcmp(err.text, "too many values"));
+
+    memset(&limits, 0, sizeof(limits));
+    limits.max_depth = 2;
+    json = ubjson_loadb_opts("[[]]", 4, 0, &opts, &err);
+    check(json_is_array(json));
+    json_decref(json);
+    json = ubjson_loadb_opts("[[[]]]", 6, 0, &opts, &err);
+    check(!json && !strcmp(err.text, "maximum nesting depth exceeded"));
+
+    memset(&limits, 0, sizeof(limits));
+    limits.max_string_length = 3;
+    json = ubjson_loadb_opts("{i\x03""abcSi\x04""abcd}", 13, 0, &opts, &err);
+    check(!json && !strcmp(err.text, "string too long") && err.position == 9);
+    limits.max_count = 1;
+    json = ubjson_loadb_opts("[ZZ]", 4, 0, &opts, &err);
+    check(!json && !strcmp(err.text, "too many items"));
+}
+
+static void test_typed_array(void)
+{
+    int16_t in16[300], out16[300];
+    int64_t in64[3] = { -1, 0x0102030405060708LL, 42 }, out64[3];
+    double ind[2] = { 0.5, -1e300 }, outd[2];
+    int32_t out32[4];
+    unsigned char buf[0x400];
+    json_error_t err;
+    json_t *json;
+    size_t i, count;
+    ssize_t len, r;
+
+    for(i = 0; i < 300; ++i)
+        in16[i] = (int16_t)(i * 257 - 30000);
+
+    /* nested inside an object */
+    memcpy(buf, "{#i\x01i\x01""a", 7);
+    len = ubjson_dumpb_typed_array(UBJSON_TYPE_INT16, in16, 300, buf + 7, sizeof(buf) - 7);
+    check(len == 4 + 9 + 600 && !memcmp(buf + 7, "[$I#L", 5) && buf[20] == 0x8a && buf[21] == 0xd0);
+    json = ubjson_loadb(buf, 7 + len, 0, &err);
+    check(json_array_size(json_object_get(json, "a")) == 300);
+    check(json_integer_value(json_array_get(json_object_get(json, "a"), 299)) == in16[299]);
+    json_decref(json);
+
+    r = ubjson_load_typed_array(buf + 7, len, UBJSON_TYPE_INT16, out16, 300, &count, &err);
+    check(r == len && count == 300 && !memcmp(in16, out16, sizeof(in16)));
+    check(ubjson_load_typed_array(buf + 7, len, UBJSON_TYPE_INT16, out16, 299, &count, &err) == -1);
+
+    len = ubjson_dumpb_typed_array(UBJSON_TYPE_INT64, in64, 3, buf, sizeof(buf));
+    check(ubjson_load_typed_array(buf, len, UBJSON_TYPE_INT64, out64, 3, &count, &err) == len);
+    check(count == 3 && !memcmp(in64, out64, sizeof(in64)) && buf[13] == 0xff && buf[21] == 0x01);
+
+    len = ubjson_dumpb_typed_array(UBJSON_TYPE_FLOAT64, ind, 2, buf, sizeof(buf));
+    check(ubjson_load_typed_array(buf, len, UBJSON_TYPE_FLOAT64, outd, 2, &count, &err) == len);
+    check(count == 2 && outd[0] == 0.5 && outd[1] == -1e300);
+
+    /* other encodings are converted element by element */
+    check(ubjson_load_typed_array("[i\x01U\xffI\x01\x00Hi\x02""-5]", 14, UBJSON_TYPE_INT32, out32, 4, &count, &err) == 14);
+    check(count == 4 && out32[0] == 1 && out32[1] == 255 && out32[2] == 256 && out32[3] == -5);
+    check(ubjson_load_typed_array("[$U#i\x01\xff", 7, UBJSON_TYPE_INT8, out16, 4, &count, &err) == -1);
+    check(!strcmp(err.text, "integer out of range"));
+    check(ubjson_load_typed_array("[Hi\x13""9223372036854775808]", 24, UBJSON_TYPE_INT64, out64, 3, &count, &err) == -1);
+    check(!strcmp(err.text, "integer out of range"));
+    check(ubjson_load_typed_array("[Hi\x05""1e999]", 10, UBJSON_TYPE_FLOAT64, outd, 2, &count, &err) == -1);
+    check(ubjson_load_typed_array("[Hi\x03""nan]", 8, UBJSON_TYPE_FLOAT64, outd, 2, &count, &err) == -1);
+    check(ubjson_load_typed_array("[Hi\x04""0x10]", 9, UBJSON_TYPE_INT32, out32, 4, &count, &err) == -1);
+    check(ubjson_load_typed_array("[Hi\x02"" 1]", 7, UBJSON_TYPE_INT32, out32, 4, &count, &err) == -1);
+    check(ubjson_load_typed_array("[Hi\x02""+1]", 7, UBJSON_TYPE_INT32, out32, 4, &count, &err) == -1);
+
+    /* no-op elements take no input, whatever their count */
+    memcpy(buf, "[$N#L\x7f\xff\xff\xff\xff\xff\xff\xff", 13);
+    check(ubjson_load_typed_array(buf, 13, UBJSON_TYPE_INT32, out32, 4, &count, &err) == -1);
+    check(!strcmp(err.text, "too many items"));
+    memcpy(buf, "[$N#L\x00\x00\x00\x00\x00\x0f\x00\x00", 13);
+    check(ubjson_load_typed_array(buf, 13, UBJSON_TYPE_INT32, out32, 4, &count, &err) == 13 && count == 0);
+}
+
+struct named {
+    ubjson_string_ref_t name;
+    int32_t id;
+};
+
+static const ubjson_field_t named_fields[] = {
+    UBJSON_FIELD(struct named, name, UBJSON_TYPE_STRING_REF),
+    UBJSON_FIELD(struct named, id, UBJSON_TYPE_INT32),
+};
+
+static void test_load_file(void)
+{
+    const char *path = "ubjson_test.ubj";
+    const char doc[] = "{i\x04""nameSi\x05""helloi\x02""idU\x07}";
+    ubjson_mapping_t *mapping;
+    struct named out;
+    unsigned char buf[0x40];
+    json_error_t err;
+    json_t *json;
+    const void *data;
+    size_t len;
+    FILE *F;
+
+    F = fopen(path, "wb");
+    check(F && fwrite(doc, sizeof(doc) - 1, 1, F) == 1);
+    if(F)
+        fclose(F);
+
+    json = ubjson_load_file(path, 0, &err);
+    check(!strcmp(json_string_value(json_object_get(json, "name")), "hello"));
+    json_decref(json);
+
+    mapping = ubjson_mapping_open(path, &err);
+    check(mapping != NULL);
+    if(mapping) {
+        data = ubjson_mapping_data(mapping, &len);
+        check(len == sizeof(doc) - 1);
+        check(!ubjson_loadb_struct(data, len, named_fields, 2, &out, 0, &err));
+        check(out.id == 7 && out.name.len == 5 && !memcmp(out.name.str, "hello", 5));
+        check(out.name.str == (const char *)data + 10);
+        check(ubjson_dumpb_struct(&out, named_fields, 2, buf, sizeof(buf)) == 59);
+        check(!memcmp(buf, "{#L\0\0\0\0\0\0\0\x02""L\0\0\0\0\0\0\0\x04""nameS", 25));
+        ubjson_mapping_close(mapping);
+    }
+
+    F = fopen(path, "ab");
+    if(F) {
+        fputc('Z', F);
+        fclose(F);
+    }
+    json = ubjson_load_file(path, 0, &err);
+    check(!json && !strcmp(err.text, "end of file expected") && !strcmp(err.source, path));
+    remove(path);
+
+    json = ubjson_load_file(path, 0, &err);
+    check(!json && !strncmp(err.text, "unable to open", 14));
+}
+
+static void test_intern(void)
+{
+    ubjson_intern_t *intern;
+    ubjson_load_opts_t opts;
+    json_error_t err;
+    json_t *json, *json2;
+    size_t hits, misses, entries;
+
+    intern = ubjson_intern_new(2, 4);
+    memset(&opts, 0, sizeof(opts));
+    opts.intern = intern;
+
+    json = ubjson_loadb_opts("[Si\x02""okSi\x02""okSi\x06""longerSi\x02""noSi\x03""yesSi\x03""yes]", 38, 0, &opts, &err);
+    check(json_array_size(json) == 6);
+    check(json_array_get(json, 0) == json_array_get(json, 1));
+    check(!strcmp(json_string_value(json_array_get(json, 2)), "longer"));
+    /* the table is full, so "yes" is not shared */
+    check(json_array_get(json, 4) != json_array_get(json, 5));
+    check(!strcmp(json_string_value(json_array_get(json, 5)), "yes"));
+
+    json2 = ubjson_loadb_opts("{i\x01""aSi\x02""no}", 10, 0, &opts, &err);
+    check(json_object_get(json2, "a") == json_array_get(json, 3));
+    json_decref(json2);
+
+    ubjson_intern_stats(intern, &hits, &misses, &entries);
+    check(hits == 2 && misses == 4 && entries == 2);
+
+    /* strings stay valid after the table is freed */
+    ubjson_intern_free(intern);
+    check(!strcmp(json_string_value(json_array_get(json, 0)), "ok"));
+    json_decref(json);
+}
+
+static int count_calls(const char *buffer, size_t size, void *data)
+{
+    (void)buffer;
+    (void)size;
+    ++*(int *)data;
+    return 0;
+}
+
+static int fail_calls(const char *buffer, size_t size, void *data)
+{
+    (void)buffer;
+    (void)size;
+    return (--*(int *)data < 0) ? -1 : 0;
+}
+
+static void test_cache(void)
+{
+    ubjson_dump_opts_t opts;
+    unsigned char buf[0x100], expect[0x100];
+    json_t *json, *a, *b;
+    ssize_t len;
+    int calls = 0, uncached;
+
+    json = json_pack("{s{si}s[ii]}", "a", "x", 1, "b", 2, 3);
+    a = json_object_get(json, "a");
+    b = json_object_get(json, "b");
+    json_object_set(a, "shared", b);
+
+    memset(&opts, 0, sizeof(opts));
+    opts.cache = ubjson_cache_new();
+    len = ubjson_dumpb_opts(json, buf, sizeof(buf), 0, &opts);
+    check(len > 0 && len == ubjson_dumpb(json, expect, sizeof(expect), 0) && !memcmp(buf, expect, len));
+    check(ubjson_cache_size(opts.cache) == 3);
+
+    /* the whole document comes from the cache in one write */
+    check(!ubjson_dump_callback_opts(json, count_calls, &calls, 0, &opts) && calls == 1);
+
+    /* b is included in a and in the root */
+    json_array_append_new(b, json_integer(4));
+    ubjson_cache_invalidate(opts.cache, b);
+    check(ubjson_cache_size(opts.cache) == 0);
+    len = ubjson_dumpb_opts(json, buf, sizeof(buf), 0, &opts);
+    check(len == ubjson_dumpb(json, expect, sizeof(expect), 0) && !memcmp(buf, expect, len));
+
+    /* b is inside a, and stays cached */
+    json_integer_set(json_object_get(a, "x"), 5);
+    ubjson_cache_invalidate(opts.cache, a);
+    check(ubjson_cache_size(opts.cache) == 1);
+    len = ubjson_dumpb_opts(json, buf, sizeof(buf), 0, &opts);
+    check(len == ubjson_dumpb(json, expect, sizeof(expect), 0) && !memcmp(buf, expect, len));
+    check(ubjson_cache_size(opts.cache) == 3);
+
+    /* only the root is encoded again: a and b come from the cache */
+    json_object_set_new(json, "c", json_true());
+    ubjson_cache_invalidate(opts.cache, json);
+    check(ubjson_cache_size(opts.cache) == 2);
+    calls = 0;
+    check(!ubjson_dump_callback_opts(json, count_calls, &calls, 0, &opts));
+    check(ubjson_cache_size(opts.cache) == 3);
+    uncached = 0;
+    check(!ubjson_dump_callback(json, count_calls, &uncached, 0) && calls > 1 && calls < uncached - 4);
+
+    /* a removed child is not kept alive by the cache */
+    b = json_incref(b);
+    json_object_set_new(json, "b", json_array());
+    json_object_del(a, "shared");
+    ubjson_cache_invalidate(opts.cache, a);
+    check(ubjson_cache_size(opts.cache) == 1 && b->refcount == 2);
+    len = ubjson_dumpb_opts(json, buf, sizeof(buf), 0, &opts);
+    check(len == ubjson_dumpb(json, expect, sizeof(expect), 0) && !memcmp(buf, expect, len));
+    check(ubjson_cache_size(opts.cache) == 3 && b->refcount == 1);
+    json_decref(b);
+
+    /* a failed write leaves nothing behind that a later dump would reuse */
+    uncached = 0;
+    check(!ubjson_dump_callback(json, count_calls, &uncached, 0));
+    for(calls = 0; calls < uncached; ++calls) {
+        int left = calls;
+
+        ubjson_cache_clear(opts.cache);
+        check(ubjson_dump_callback_opts(json, fail_calls, &left, 0, &opts) == -1);
+        len = ubjson_dumpb_opts(json, buf, sizeof(buf), 0, &opts);
+        check(len == ubjson_dumpb(json, expect, sizeof(expect), 0) && !memcmp(buf, expect, len));
+    }
+
+    /* cached values stay alive until the cache is cleared */
+    json_decref(json);
+    ubjson_cache_clear(opts.cache);
+    check(ubjson_cache_size(opts.cache) == 0);
+    ubjson_cache_free(opts.cache);
+}
+
+static void test_writer(void)
+{
+    ubjson_writer_t *writer;
+    unsigned char buf[0x100], expect_buf[0x100];
+    size_t len;
+    const int16_t samples[2] = { 7, -7 };
+    json_error_t err;
+    json_t *json, *expect;
+
+    writer = ubjson_writer_new_buffer(buf, sizeof(buf));
+    check(!ubjson_writer_begin_object(writer, 0, 5));
+    check(!ubjson_writer_key(writer, "n", 1));
+    check(!ubjson_writer_begin_array(writer, UBJSON_TYPE_INT32, 3));
+    check(!ubjson_writer_int(writer, 1) && !ubjson_writer_int(writer, -2) && !ubjson_writer_int(writer, 300));
+    check(!ubjson_writer_end_array(writer));
+    check(!ubjson_writer_key(writer, "u", 1));
+    check(!ubjson_writer_begin_array(writer, 0, -1));
+    check(!ubjson_writer_bool(writer, 1) && !ubjson_writer_null(writer) && !ubjson_writer_real(writer, 1.5));
+    check(!ubjson_writer_string(writer, "x", 1));
+    check(!ubjson_writer_end_array(writer));
+    check(!ubjson_writer_key(writer, "t", 1));
+    check(!ubjson_writer_begin_object(writer, 'T', 1));
+    check(!ubjson_writer_key(writer, "y", 1) && !ubjson_writer_bool(writer, 1));
+    check(!ubjson_writer_end_object(writer));
+    check(!ubjson_writer_key(writer, "a", 1));
+    check(!ubjson_writer_typed_array(writer, UBJSON_TYPE_INT16, samples, 2));
+    check(!ubjson_writer_key(writer, "j", 1));
+    expect = json_pack("{s[is]}", "k", 5, "v");
+    check(!ubjson_writer_json(writer, json_object_get(expect, "k"), 0));
+    json_decref(expect);
+    check(!ubjson_writer_end_object(writer));
+    check(ubjson_writer_size(writer) <= sizeof(buf));
+
+    json = ubjson_loadb(buf, ubjson_writer_size(writer), 0, &err);
+    expect = json_pack("{s[iii]s[bnfs]s{sb}s[ii]s[is]}", "n", 1, -2, 300, "u", 1, 1.5, "x",
+                       "t", "y", 1, "a", 7, -7, "j", 5, "v");
+    check(json_equal(json, expect));
+    json_decref(json);
+    json_decref(expect);
+    check(!memcmp(buf, "{#L", 3) && !memcmp(buf + 21, "[$l#L", 5));
+    check(!ubjson_writer_close(writer));
+
+    /* nesting is checked */
+    writer = ubjson_writer_new_buffer(NULL, 0);
+    check(!ubjson_writer_begin_object(writer, 0, -1));
+    check(ubjson_writer_int(writer, 1) == -1);
+    check(ubjson_writer_end_object(writer) == -1);
+    check(ubjson_writer_close(writer) == -1);
+
+    writer = ubjson_writer_new_buffer(NULL, 0);
+    check(!ubjson_writer_begin_array(writer, UBJSON_TYPE_UINT8, 1));
+    check(ubjson_writer_int(writer, 256) == -1);
+    check(ubjson_writer_close(writer) == -1);
+
+    writer = ubjson_writer_new_buffer(NULL, 0);
+    check(!ubjson_writer_begin_array(writer, 0, 1));
+    check(ubjson_writer_end_array(writer) == -1);
+    check(ubjson_writer_close(writer) == -1);
+
+    writer = ubjson_writer_new_buffer(NULL, 0);
+    check(!ubjson_writer_begin_array(writer, 0, -1));
+    check(ubjson_writer_end_object(writer) == -1);
+    check(ubjson_writer_close(writer) == -1);
+
+    writer = ubjson_writer_new_buffer(NULL, 0);
+    check(!ubjson_writer_begin_array(writer, 0, -1) && !ubjson_writer_end_array(writer));
+    check(ubjson_writer_size(writer) == 2);
+    check(!ubjson_writer_close(writer));
+
+    /* there is only one top-level value */
+    writer = ubjson_writer_new_buffer(NULL, 0);
+    check(!ubjson_writer_begin_array(writer, 0, -1) && !ubjson_writer_end_array(writer));
+    check(ubjson_writer_begin_object(writer, 0, -1) == -1);
+    check(ubjson_writer_close(writer) == -1);
+
+    writer = ubjson_writer_new_buffer(NULL, 0);
+    check(!ubjson_writer_int(writer, 1));
+    check(ubjson_writer_null(writer) == -1);
+    check(ubjson_writer_close(writer) == -1);
+
+    /* scalars encode exactly as ubjson_dumpb() encodes them */
+    writer = ubjson_writer_new_buffer(buf, sizeof(buf));
+    check(!ubjson_writer_real(writer, 0.1));
+    len = ubjson_writer_size(writer);
+    check(!ubjson_writer_close(writer));
+    json = json_real(0.1);
+    check(len == (size_t)ubjson_dumpb(json, expect_buf, sizeof(expect_buf), JSON_ENCODE_ANY) &&
+          !memcmp(buf, expect_buf, len));
+    json_decref(json);
+
+    writer = ubjson_writer_new_buffer(buf, sizeof(buf));
+    check(!ubjson_writer_real(writer, -2.5e-300));
+    len = ubjson_writer_size(writer);
+    check(!ubjson_writer_close(writer));
+    json = json_real(-2.5e-300);
+    check(len == (size_t)ubjson_dumpb(json, expect_buf, sizeof(expect_buf), JSON_ENCODE_ANY) &&
+          !memcmp(buf, expect_buf, len) && !memcmp(buf + 10, "-2.5e-300", 9));
+    json_decref(json);
+
+    writer = ubjson_writer_new_buffer(buf, sizeof(buf));
+    check(!ubjson_writer_string(writer, "a\0b", 3));
+    len = ubjson_writer_size(writer);
+    check(!ubjson_writer_close(writer));
+    json = json_stringn("a\0b", 3);
+    check(len == (size_t)ubjson_dumpb(json, expect_buf, sizeof(expect_buf), JSON_ENCODE_ANY) &&
+          !memcmp(buf, expect_buf, len));
+    json_decref(json);
+
+    writer = ubjson_writer_new_buffer(NULL, 0);
+    check(!ubjson_writer_begin_array(writer, 0, -1));
+    check(ubjson_writer_real(writer, 1.0 / 0.0) == -1);
+    check(ubjson_writer_close(writer) == -1);
+}
+
+static void test_hash(void)
+{
+    static const unsigned char abc_sha256[32] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+    };
+    ubjson_dump_opts_t opts;
+    ubjson_digest_t digest, check;
+    unsigned char buf[0x1000];
+    json_t *a, *b, *c;
+    ssize_t len;
+    int i;
+
+    check.flags = UBJSON_DIGEST_SHA256;
+    ubjson_digest_buffer("", 0, &check);
+    check(check.xxh64 == UINT64_C(0xEF46DB3751D8E999));
+    ubjson_digest_buffer("abc", 3, &check);
+    check(check.xxh64 == UINT64_C(0x44BC2CF5AD770999));
+    check(!memcmp(check.sha256, abc_sha256, 32));
+
+    a = json_pack("{sisss[ii]}", "one", 1, "two", "2", "list", 3, 4);
+    b = json_pack("{s[ii]sssi}", "list", 3, 4, "two", "2", "one", 1);
+    for(i = 0; i < 40; ++i) {
+        char key[8];
+        snprintf(key, sizeof(key), "k%d", i);
+        json_object_set_new(a, key, json_integer(i));
+        snprintf(key, sizeof(key), "k%d", 39 - i);
+        json_object_set_new(b, key, json_integer(39 - i));
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.digest = &digest;
+    digest.flags = UBJSON_DIGEST_SHA256;
+    len = ubjson_dumpb_opts(a, buf, sizeof(buf), JSON_SORT_KEYS, &opts);
+    check(len > 64 && (size_t)len <= sizeof(buf));
+
+    /* the digest covers exactly the bytes written */
+    ubjson_digest_buffer(buf, len, &check);
+    check(digest.xxh64 == check.xxh64 && !memcmp(digest.sha256, check.sha256, 32));
+
+    /* equal trees hash alike regardless of insertion order */
+    check(ubjson_dumpb_opts(b, buf, sizeof(buf), JSON_SORT_KEYS, &opts) == len);
+    check(digest.xxh64 == check.xxh64 && !memcmp(digest.sha256, check.sha256, 32));
+
+    /* and through the cache */
+    c = json_pack("[OO]", a, b);
+    opts.cache = ubjson_cache_new();
+    digest.flags = 0;
+    len = ubjson_dumpb_opts(c, buf, sizeof(buf), JSON_SORT_KEYS, &opts);
+    check(len > 0 && (size_t)len <= sizeof(buf));
+    check(ubjson_dumpb_opts(c, NULL, 0, JSON_SORT_KEYS, &opts) == len);
+    ubjson_digest_buffer(buf, len, &check);
+    check(digest.xxh64 == check.xxh64);
+    ubjson_cache_free(opts.cache);
+
+    json_decref(a);
+    json_decref(b);
+    json_decref(c);
+}
+
 int main(int argc, char *argv[])
 {
     json_t *json;
@@ -208,6 +1249,27 @@ int main(int argc, char *argv[])
         }
     }
 
+    test_convert("null", "Z");
+    test_convert("[1, -2, 300, \"a\\u00e9\\ud83d\\ude00\\n\"]", "[U\x01i\xfeI\x01\x2cSi\x08""a\xc3\xa9\xf0\x9f\x98\x80\n]");
+    test_convert("{\"a\": [true, false, null], \"bc\": {}}", "{#i\x02i\x01""a[TNFZ]Ni\x02""bc{}");
+    test_convert("{\"x\": 1.5, \"y\": 9223372036854775807}", "{i\x01xD\x3f\xf8\0\0\0\0\0\0i\x01yHi\x13""9223372036854775807}");
+    test_convert("[[[]], {\"k\": \"\\\"q\\\"\"}]", "[#i\x02[[]]{i\x01kSi\x03\"q\"}");
+
+    test_convert_errors();
+    test_recfile();
+    test_recfile_invalid();
+    test_patch();
+    test_struct();
+    test_validate();
+    test_validate_agrees();
+    test_limits();
+    test_typed_array();
+    test_load_file();
+    test_intern();
+    test_cache();
+    test_writer();
+    test_hash();
+
     printf("%d passed, %d failed\n", passed, failed);
     return failed;
 }